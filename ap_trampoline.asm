@@ -0,0 +1,75 @@
+; ap_trampoline.asm -- real-mode entry for application processors (NASM)
+; Exports: ap_trampoline_start, ap_trampoline_end
+;
+; smp_init() copies this code to AP_TRAMPOLINE_ADDR (4 KB aligned, below
+; 1 MB) and points the startup IPI at it. The code runs from the copy, so
+; every address inside it goes through TRAMP(). Once in protected mode it
+; only uses absolute kernel addresses.
+
+BITS 16
+GLOBAL ap_trampoline_start
+GLOBAL ap_trampoline_end
+
+extern ap_boot_next     ; next free cpus[] slot, claimed with lock xadd
+extern ap_boot_max      ; number of cpus[] slots
+extern ap_stack_tops    ; initial ESP for each slot
+extern ap_main          ; void ap_main(int id)
+extern enable_sse       ; in kernel_entry.asm
+
+AP_TRAMPOLINE_ADDR equ 0x8000
+%define TRAMP(label) (AP_TRAMPOLINE_ADDR + (label) - ap_trampoline_start)
+
+SECTION .text
+ap_trampoline_start:
+    cli
+    cld
+    xor  ax, ax
+    mov  ds, ax
+
+    lgdt [TRAMP(ap_gdt_descriptor)]
+
+    mov  eax, cr0
+    or   eax, 1
+    mov  cr0, eax
+    jmp  dword 0x08:TRAMP(ap_pm_entry) ; far jump to load CS
+
+BITS 32
+ap_pm_entry:
+    mov  ax, 0x10
+    mov  ds, ax
+    mov  es, ax
+    mov  ss, ax
+    mov  fs, ax
+    mov  gs, ax
+
+    ; Claim a per-CPU slot, park for good if there are none left
+    mov  eax, 1
+    lock xadd [ap_boot_next], eax
+    cmp  eax, [ap_boot_max]
+    jae  .park
+
+    mov  esp, [ap_stack_tops + eax*4]
+    push eax
+    mov  ecx, enable_sse ; absolute, as below
+    call ecx
+    mov  eax, ap_main   ; absolute, a relative call would be off in the copy
+    call eax
+
+.park:
+    cli
+    hlt
+    jmp  .park
+
+; Flat GDT used until ap_main loads the CPU's own one
+align 8
+ap_gdt:
+    dq 0x0000000000000000
+    dq 0x00CF9A000000FFFF ; code: base=0, limit=4GB
+    dq 0x00CF92000000FFFF ; data: base=0, limit=4GB
+ap_gdt_end:
+
+ap_gdt_descriptor:
+    dw ap_gdt_end - ap_gdt - 1
+    dd TRAMP(ap_gdt)
+
+ap_trampoline_end:
@@ -0,0 +1,708 @@
+// bot.c — autoplay: bitmask boards, the board evaluator and a greedy bot
+// Every feature is a popcount of a few shifts and masks per row, with no
+// per-cell loops or data-dependent branches. With SSE2 (-march=pentium4 or
+// any x86-64 host) board_evaluate_many works on eight boards at once, one
+// per 16-bit lane.
+
+#include "bot.h"
+
+// Hand-tuned with a greedy one-piece bot in the headless simulator: about
+// 1750 lines per game on average over 5000-piece games
+const struct eval_terms eval_default_weights = {
+    .height = -100,
+    .holes = -700,
+    .bumpiness = -100,
+    .row_transitions = -300,
+    .col_transitions = -900,
+    .wells = -300,
+    .lines = 300,
+};
+
+// Per-byte popcount: each byte of the result is the number of bits set in
+// that byte. Sums of these stay per byte as long as no byte passes 255,
+// which twenty rows of at most eight bits cannot.
+static inline uint32_t popcount_bytes(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+
+    return (x + (x >> 4)) & 0x0F0F0F0F;
+}
+
+// Zobrist keys: one random key per cell, combined per half row ahead of
+// time, so a row's share of the hash is two lookups whatever its cells.
+// Filled in once by zobrist_init; until then every hash is 0.
+#define ZOBRIST_SPLIT 5 // Cells per half row
+
+#if GRID_SIZE_X > 2 * ZOBRIST_SPLIT
+#error "ZOBRIST_SPLIT too small for GRID_SIZE_X"
+#endif
+
+static uint64_t zobrist_rows[GRID_SIZE_Y][2][1 << ZOBRIST_SPLIT];
+static uint64_t zobrist_next[PIECE_TYPES];
+
+static uint64_t splitmix64(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+void zobrist_init(void)
+{
+    uint64_t state = 0x7E7215;
+
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        for (int half = 0; half < 2; half++) {
+            uint64_t* keys = zobrist_rows[y][half];
+
+            keys[0] = 0;
+            for (int bit = 0; bit < ZOBRIST_SPLIT; bit++) {
+                keys[1 << bit] = splitmix64(&state);
+            }
+
+            // Every other pattern is the XOR of its cells' keys
+            for (int m = 3; m < 1 << ZOBRIST_SPLIT; m++) {
+                keys[m] = keys[m & (m - 1)] ^ keys[m & -m];
+            }
+        }
+    }
+
+    for (int i = 0; i < PIECE_TYPES; i++) {
+        zobrist_next[i] = splitmix64(&state);
+    }
+}
+
+static inline uint64_t zobrist_row(int y, uint32_t row)
+{
+    return zobrist_rows[y][0][row & ((1 << ZOBRIST_SPLIT) - 1)] ^ zobrist_rows[y][1][row >> ZOBRIST_SPLIT];
+}
+
+uint64_t board_hash(const struct board* board)
+{
+    uint64_t hash = 0;
+
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        hash ^= zobrist_row(y, board->rows[y]);
+    }
+
+    return hash;
+}
+
+static inline void board_set_row(struct board* board, int y, uint16_t row)
+{
+    board->hash ^= zobrist_row(y, board->rows[y]) ^ zobrist_row(y, row);
+    board->rows[y] = row;
+}
+
+// Leaves out the cells of tetrominoe (the falling piece), if given
+void board_from_grid(struct board* board, int grid[GRID_SIZE_X][GRID_SIZE_Y], int tetrominoe[4][2])
+{
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        uint32_t row = 0;
+
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            row |= (uint32_t)(grid[x][y] != 0) << x;
+        }
+
+        board->rows[y] = row;
+    }
+
+    if (tetrominoe) {
+        for (int i = 0; i < 4; i++) {
+            board->rows[tetrominoe[i][1]] &= ~(1 << tetrominoe[i][0]);
+        }
+    }
+
+    board->hash = board_hash(board);
+}
+
+// Lock the piece's cells and remove full rows, as do_remove_lines does,
+// keeping the hash up to date. Returns the number of lines cleared.
+int board_place(struct board* board, int tetrominoe[4][2])
+{
+    int dst = GRID_SIZE_Y - 1;
+    int full = 0;
+    int lines;
+
+    for (int i = 0; i < 4; i++) {
+        int x = tetrominoe[i][0];
+        int y = tetrominoe[i][1];
+
+        board->rows[y] |= 1 << x;
+        board->hash ^= zobrist_rows[y][x >= ZOBRIST_SPLIT][1 << (x % ZOBRIST_SPLIT)];
+    }
+
+    // Only the piece's rows can have filled up
+    for (int i = 0; i < 4; i++) {
+        full |= board->rows[tetrominoe[i][1]] == BOARD_FULL_ROW;
+    }
+
+    if (!full) return 0;
+
+    for (int y = GRID_SIZE_Y - 1; y >= 0; y--) {
+        uint16_t row = board->rows[y];
+
+        if (dst != y) board_set_row(board, dst, row);
+        dst -= row != BOARD_FULL_ROW;
+    }
+
+    lines = dst + 1;
+    for (; dst >= 0; dst--) {
+        board_set_row(board, dst, 0);
+    }
+
+    return lines;
+}
+
+// Top to bottom, cover is the union of the rows so far: the cells at or
+// below the top of their column. Column heights, holes and bumpiness all
+// follow from it without finding any column's top. Features go two to a
+// word, one per 16-bit half, and are counted bytewise until the end.
+void board_features(const struct board* board, int lines, struct eval_terms* features)
+{
+    uint32_t cover = 0;
+    uint32_t above = 0;
+    uint32_t height_holes = 0;
+    uint32_t bumpiness_wells = 0;
+    uint32_t transitions = 0;
+    int top = 0;
+
+    // Empty rows above the stack only add their two wall transitions
+    while (top < GRID_SIZE_Y && !board->rows[top]) {
+        top++;
+    }
+
+    for (int y = top; y < GRID_SIZE_Y; y++) {
+        uint32_t row = board->rows[y];
+        uint32_t walled = row << 1 | 1 | 1 << (GRID_SIZE_X + 1);
+        uint32_t wells;
+
+        cover |= row;
+        wells = ~cover & (row << 1 | 1) & (row >> 1 | 1 << (GRID_SIZE_X - 1)) & BOARD_FULL_ROW;
+
+        height_holes += popcount_bytes(cover | (cover & ~row) << 16);
+        bumpiness_wells += popcount_bytes(((cover ^ cover >> 1) & (BOARD_FULL_ROW >> 1)) | wells << 16);
+        transitions += popcount_bytes(((walled ^ walled >> 1) & ((2 << GRID_SIZE_X) - 1)) | (above ^ row) << 16);
+
+        above = row;
+    }
+
+    transitions += popcount_bytes((above ^ BOARD_FULL_ROW) << 16);
+
+    features->height = (height_holes & 0xFF) + (height_holes >> 8 & 0xFF);
+    features->holes = (height_holes >> 16 & 0xFF) + (height_holes >> 24);
+    features->bumpiness = (bumpiness_wells & 0xFF) + (bumpiness_wells >> 8 & 0xFF);
+    features->wells = (bumpiness_wells >> 16 & 0xFF) + (bumpiness_wells >> 24);
+    features->row_transitions = (transitions & 0xFF) + (transitions >> 8 & 0xFF) + 2 * top;
+    features->col_transitions = (transitions >> 16 & 0xFF) + (transitions >> 24);
+    features->lines = lines;
+}
+
+static int eval_dot(const struct eval_terms* features, const struct eval_terms* weights)
+{
+    return features->height * weights->height
+        + features->holes * weights->holes
+        + features->bumpiness * weights->bumpiness
+        + features->row_transitions * weights->row_transitions
+        + features->col_transitions * weights->col_transitions
+        + features->wells * weights->wells
+        + features->lines * weights->lines;
+}
+
+int board_evaluate(const struct board* board, int lines, const struct eval_terms* weights)
+{
+    struct eval_terms features;
+
+    board_features(board, lines, &features);
+
+    return eval_dot(&features, weights);
+}
+
+#ifdef __SSE2__
+// Eight boards side by side, row y of board i in lane i. GCC lowers these
+// to SSE2 without needing the intrinsics headers, which are not freestanding.
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+
+// popcount_bytes per lane
+static inline v8u16 popcount_v8(v8u16 x)
+{
+    x = x - ((x >> 1) & 0x5555);
+    x = (x & 0x3333) + ((x >> 2) & 0x3333);
+
+    return (x + (x >> 4)) & 0x0F0F;
+}
+
+static void board_evaluate_8(const struct board* b, const int* lines, const struct eval_terms* weights, int* scores)
+{
+    v8u16 cover = { 0 };
+    v8u16 above = { 0 };
+    v8u16 height = { 0 };
+    v8u16 holes = { 0 };
+    v8u16 bumpiness = { 0 };
+    v8u16 row_transitions = { 0 };
+    v8u16 col_transitions = { 0 };
+    v8u16 wells = { 0 };
+    int top = 0;
+
+    // Skip the rows that are empty on all eight boards
+    while (top < GRID_SIZE_Y && !(b[0].rows[top] | b[1].rows[top] | b[2].rows[top] | b[3].rows[top]
+            | b[4].rows[top] | b[5].rows[top] | b[6].rows[top] | b[7].rows[top])) {
+        top++;
+    }
+
+    for (int y = top; y < GRID_SIZE_Y; y++) {
+        v8u16 row = {
+            b[0].rows[y], b[1].rows[y], b[2].rows[y], b[3].rows[y],
+            b[4].rows[y], b[5].rows[y], b[6].rows[y], b[7].rows[y]
+        };
+        v8u16 walled = row << 1 | 1 | 1 << (GRID_SIZE_X + 1);
+
+        cover |= row;
+
+        height += popcount_v8(cover);
+        holes += popcount_v8(cover & ~row);
+        bumpiness += popcount_v8((cover ^ cover >> 1) & (BOARD_FULL_ROW >> 1));
+        row_transitions += popcount_v8((walled ^ walled >> 1) & ((2 << GRID_SIZE_X) - 1));
+        col_transitions += popcount_v8(above ^ row);
+        wells += popcount_v8(~cover & (row << 1 | 1) & (row >> 1 | 1 << (GRID_SIZE_X - 1)) & BOARD_FULL_ROW);
+
+        above = row;
+    }
+
+    col_transitions += popcount_v8(above ^ BOARD_FULL_ROW);
+
+    for (int i = 0; i < 8; i++) {
+        struct eval_terms features = {
+            .height = (height[i] & 0xFF) + (height[i] >> 8),
+            .holes = (holes[i] & 0xFF) + (holes[i] >> 8),
+            .bumpiness = (bumpiness[i] & 0xFF) + (bumpiness[i] >> 8),
+            .row_transitions = (row_transitions[i] & 0xFF) + (row_transitions[i] >> 8) + 2 * top,
+            .col_transitions = (col_transitions[i] & 0xFF) + (col_transitions[i] >> 8),
+            .wells = (wells[i] & 0xFF) + (wells[i] >> 8),
+            .lines = lines[i],
+        };
+
+        scores[i] = eval_dot(&features, weights);
+    }
+}
+#endif
+
+// Score count boards, lines[i] being what placement i cleared. Same results
+// as board_evaluate on each.
+void board_evaluate_many(const struct board* boards, const int* lines, int count, const struct eval_terms* weights, int* scores)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        board_evaluate_8(boards + i, lines + i, weights, scores + i);
+    }
+#endif
+
+    for (; i < count; i++) {
+        scores[i] = board_evaluate(&boards[i], lines[i], weights);
+    }
+}
+
+// Scores are kept in 24 bits wherever they are packed with something else
+#define SCORE_PACK_MIN (-0x800000)
+#define SCORE_PACK_MAX 0x7FFFFF
+
+static uint32_t score_pack(int score)
+{
+    if (score < SCORE_PACK_MIN) score = SCORE_PACK_MIN;
+    if (score > SCORE_PACK_MAX) score = SCORE_PACK_MAX;
+
+    return (uint32_t)(score - SCORE_PACK_MIN);
+}
+
+// Transposition table
+// Entry data is the packed score above a live bit and the depth: 0 for a
+// board's own evaluation, 1 for the best over the next piece's placements
+// (keyed with that piece).
+#define TT_LIVE 0x80
+#define TT_DEPTH 0x7F
+
+// memory must be 64-byte aligned; the table takes the largest power of two
+// buckets that fit in bytes.
+void tt_init(struct tt* tt, void* memory, uint32_t bytes)
+{
+    uint32_t count = 1;
+
+    tt->buckets = memory;
+    tt->mask = 0;
+
+    if (!memory || bytes < sizeof(struct tt_bucket)) {
+        tt->buckets = 0;
+        return;
+    }
+
+    while (count * 2 <= bytes / sizeof(struct tt_bucket)) {
+        count *= 2;
+    }
+    tt->mask = count - 1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        for (int j = 0; j < TT_BUCKET_ENTRIES; j++) {
+            tt->buckets[i].entries[j].check = 0;
+            tt->buckets[i].entries[j].data = 0;
+        }
+    }
+}
+
+int tt_probe(struct tt* tt, uint64_t key, int depth, int* score, struct tt_stats* stats)
+{
+    struct tt_bucket* bucket;
+    uint32_t check = (uint32_t)(key >> 32);
+
+    if (!tt || !tt->buckets) return 0;
+
+    stats->probes++;
+    bucket = &tt->buckets[(uint32_t)key & tt->mask];
+
+    for (int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+        struct tt_entry* entry = &bucket->entries[i];
+        uint32_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+        if ((data & (TT_LIVE | TT_DEPTH)) == (TT_LIVE | (uint32_t)depth)
+                && (__atomic_load_n(&entry->check, __ATOMIC_RELAXED) ^ data) == check) {
+            *score = (int)(data >> 8) + SCORE_PACK_MIN;
+            stats->hits++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Goes in an empty slot or over the same key, else over the shallowest
+// entry, starting from a slot picked by the key so ties spread out
+void tt_store(struct tt* tt, uint64_t key, int depth, int score, struct tt_stats* stats)
+{
+    struct tt_bucket* bucket;
+    struct tt_entry* victim = 0;
+    uint32_t check = (uint32_t)(key >> 32);
+    uint32_t data = score_pack(score) << 8 | TT_LIVE | depth;
+    int victim_depth = TT_DEPTH + 1;
+
+    if (!tt || !tt->buckets) return;
+
+    bucket = &tt->buckets[(uint32_t)key & tt->mask];
+
+    for (int n = 0; n < TT_BUCKET_ENTRIES; n++) {
+        struct tt_entry* entry = &bucket->entries[(check + n) & (TT_BUCKET_ENTRIES - 1)];
+        uint32_t old = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+        if (!(old & TT_LIVE) || (__atomic_load_n(&entry->check, __ATOMIC_RELAXED) ^ old) == check) {
+            victim = entry;
+            victim_depth = -1;
+            break;
+        }
+
+        if ((int)(old & TT_DEPTH) < victim_depth) {
+            victim = entry;
+            victim_depth = old & TT_DEPTH;
+        }
+    }
+
+    if (victim_depth >= 0) stats->evictions++;
+    stats->stores++;
+
+    // A reader between the two stores sees words that disagree: a miss
+    __atomic_store_n(&victim->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->check, check ^ data, __ATOMIC_RELAXED);
+}
+
+// Autoplay
+// One-piece lookahead: every reachable placement is scored on the board it
+// leaves, all in one board_evaluate_many call, and the best one is kept as
+// the target until the piece locks. The route is searched again before each
+// input, so gravity or a blocked move only changes the route, not the goal.
+
+void bot_init(struct bot* bot, const struct eval_terms* weights)
+{
+    bot->weights = weights ? weights : &eval_default_weights;
+    bot->has_target = 0;
+    bot->choices = 0;
+    bot->nodes = 0;
+    bot->truncated = 0;
+    bot->tt = 0;
+}
+
+// Choose a target for the piece in play. Returns 0 if it cannot move at all.
+int bot_choose(struct bot* bot, struct game* game)
+{
+    struct board board;
+    int count;
+    int best = 0;
+
+    count = find_placements(&bot->search, game->tetrominoe, game->grid, game->current, bot->placements, PLACEMENT_MAX);
+    bot->nodes += bot->search.nodes;
+    bot->truncated += bot->search.truncated;
+    bot->has_target = 0;
+    bot->count = 0;
+
+    if (!count) return 0;
+
+    board_from_grid(&board, game->grid, game->tetrominoe);
+    for (int i = 0; i < count; i++) {
+        bot->boards[i] = board;
+        bot->lines[i] = board_place(&bot->boards[i], bot->placements[i].tetrominoe);
+    }
+
+    board_evaluate_many(bot->boards, bot->lines, count, bot->weights, bot->scores);
+    bot->count = count;
+
+    // Ties go to the shorter route, which the search lists first
+    for (int i = 1; i < count; i++) {
+        if (bot->scores[i] > bot->scores[best]) best = i;
+    }
+
+    copy_tetrominoe(bot->placements[best].tetrominoe, bot->target);
+    bot->best = best;
+    bot->piece = game->pieces;
+    bot->has_target = 1;
+    bot->choices++;
+
+    return 1;
+}
+
+// The next input toward the target: L, R, U (rotate), D (down one row) or
+// S once only downward moves are left, i.e. drop until the piece locks.
+// Returns 0 if the piece has nowhere to go.
+char bot_next_input(struct bot* bot, struct game* game)
+{
+    struct placement* route;
+    int count;
+
+    if (bot->has_target && bot->piece == game->pieces) {
+        count = find_placements(&bot->search, game->tetrominoe, game->grid, game->current, bot->placements, PLACEMENT_MAX);
+        bot->nodes += bot->search.nodes;
+
+        bot->best = -1;
+        for (int i = 0; i < count && bot->best < 0; i++) {
+            if (same_cells(bot->placements[i].tetrominoe, bot->target)) bot->best = i;
+        }
+
+        // The target went out of reach: pick again from here
+        if (bot->best < 0 && !bot_choose(bot, game)) return 0;
+    } else if (!bot_choose(bot, game)) {
+        return 0;
+    }
+
+    route = &bot->placements[bot->best];
+
+    for (int i = 0; i < route->inputs; i++) {
+        if (route->input[i] != 'D') return route->input[0];
+    }
+
+    return 'S';
+}
+
+// One turn of inputs: a tap per move, or at high gravity every move and
+// rotation up to the next drop, with a pause after each so that it is
+// played before the route is searched again. Drops hold down until the
+// piece locks; down is let go before any other key, since game_step ignores
+// new keys while one is held.
+void bot_play_turn(struct bot* bot, struct game* game, struct bot_keys* keys, int speed)
+{
+    int burst = game->fall_delay + 1 < BOT_BURST_TICKS * speed;
+    char input;
+
+    for (int i = 0; i < PLACEMENT_MAX_INPUTS; i++) {
+        input = bot_next_input(bot, game);
+
+        if (keys->held && (input != 'S' || keys->held != game->pieces + 1)) {
+            keys->set_key(keys->ctx, 'D', 0);
+            keys->held = 0;
+        }
+
+        switch (input) {
+            case 'L':
+            case 'R':
+            case 'U':
+                keys->set_key(keys->ctx, input, 1);
+                keys->set_key(keys->ctx, input, 0);
+                break;
+            case 'D':
+                keys->set_key(keys->ctx, 'D', 1);
+                keys->set_key(keys->ctx, 'D', 0);
+                return;
+            case 'S':
+                if (!keys->held) {
+                    keys->set_key(keys->ctx, 'D', 1);
+                    keys->held = game->pieces + 1;
+                }
+                return;
+            default:
+                return;
+        }
+
+        if (!burst) return;
+
+        if (keys->pause) keys->pause(keys->ctx);
+        if (game->state != STATE_DESCEND) return;
+    }
+}
+
+// Two-piece lookahead
+// bot_lookahead_start sets the one-piece choice as the target and fills in
+// the round; workers then take candidates with lookahead_claim and score
+// them with lookahead_score, each with its own scratch; bot_lookahead_finish
+// takes the best candidate scored so far. Candidates go out best one-piece
+// score first, so a round cut short has still looked at the likeliest ones.
+
+// Scores are packed above the candidate so a plain unsigned compare orders
+// by score, then by lower candidate (the shorter route). Never 0.
+static uint32_t lookahead_pack(int score, int candidate)
+{
+    return score_pack(score) << 8 | (255 - candidate);
+}
+
+// Returns 0 if there is nothing to look ahead at
+int bot_lookahead_start(struct bot* bot, struct game* game, struct lookahead* round)
+{
+    if (game->next < 0 || !bot_choose(bot, game)) return 0;
+
+    // bot_choose left each candidate's board and one-piece score in bot
+    round->weights = bot->weights;
+    round->tt = bot->tt;
+    round->count = bot->count;
+    round->type = game->current;
+    round->next = game->next;
+    round->piece = game->pieces;
+    round->claimed = 0;
+    round->scored = 0;
+    round->best = 0;
+    round->nodes = 0;
+
+    for (int i = 0; i < bot->count; i++) {
+        int j = i;
+
+        round->boards[i] = bot->boards[i];
+        round->lines[i] = bot->lines[i];
+        copy_tetrominoe(bot->placements[i].tetrominoe, round->cells[i]);
+
+        // Insertion sort, stable so equal scores keep the shorter route first
+        while (j > 0 && bot->scores[round->order[j - 1]] < bot->scores[i]) {
+            round->order[j] = round->order[j - 1];
+            j--;
+        }
+        round->order[j] = i;
+    }
+
+    return 1;
+}
+
+// The next candidate to score, or -1 once all are handed out
+int lookahead_claim(struct lookahead* round)
+{
+    uint32_t i = __atomic_fetch_add(&round->claimed, 1, __ATOMIC_RELAXED);
+
+    return i < (uint32_t)round->count ? round->order[i] : -1;
+}
+
+// The table, if the round should use it. Two pieces of the same type reach
+// the same boards in either order; otherwise repeats, leaves or candidates
+// alike, are too rare to pay for the lookups.
+static inline struct tt* lookahead_tt(const struct lookahead* round)
+{
+    return round->type == round->next ? round->tt : 0;
+}
+
+// The best the next piece can do on a board, lines it clears included but
+// not the ones that led to the board. Boards the table knows are not scored
+// again; the rest are packed to the front of scratch->boards and scored in
+// one batch.
+static int lookahead_best(struct lookahead* round, const struct board* board, struct lookahead_scratch* scratch)
+{
+    short colours[PIECE_TYPES] = { 1, 1, 1, 1, 1, 1, 1 };
+    const struct eval_terms* weights = round->weights;
+    struct tt* tt = lookahead_tt(round);
+    int best = SCORE_PACK_MIN; // The next piece cannot spawn: game over
+    int count = 0;
+    int misses = 0;
+    int score;
+
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            scratch->grid[x][y] = board->rows[y] >> x & 1;
+        }
+    }
+
+    scratch->search.nodes = 0;
+    if (create_tetrominoe(scratch->tetrominoe, scratch->grid, colours, round->next)) {
+        count = find_placements(&scratch->search, scratch->tetrominoe, scratch->grid, round->next, scratch->placements, PLACEMENT_MAX);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct board* after = &scratch->boards[misses];
+        int lines;
+
+        *after = *board;
+        lines = board_place(after, scratch->placements[i].tetrominoe);
+
+        if (tt_probe(tt, after->hash, 0, &score, &scratch->tt_stats)) {
+            score += lines * weights->lines;
+            if (score > best) best = score;
+        } else {
+            scratch->lines[misses++] = lines;
+        }
+    }
+
+    board_evaluate_many(scratch->boards, scratch->lines, misses, weights, scratch->scores);
+
+    for (int i = 0; i < misses; i++) {
+        if (scratch->scores[i] > best) best = scratch->scores[i];
+        tt_store(tt, scratch->boards[i].hash, 0, scratch->scores[i] - scratch->lines[i] * weights->lines, &scratch->tt_stats);
+    }
+
+    return best;
+}
+
+void lookahead_score(struct lookahead* round, int candidate, struct lookahead_scratch* scratch)
+{
+    const struct board* board = &round->boards[candidate];
+    struct tt* tt = lookahead_tt(round);
+    uint64_t key = board->hash ^ zobrist_next[round->next];
+    uint32_t packed;
+    uint32_t best;
+    int score;
+
+    scratch->search.nodes = 0;
+    if (!tt_probe(tt, key, 1, &score, &scratch->tt_stats)) {
+        score = lookahead_best(round, board, scratch);
+        tt_store(tt, key, 1, score, &scratch->tt_stats);
+    }
+
+    if (score > SCORE_PACK_MIN) score += round->lines[candidate] * round->weights->lines;
+
+    // Shared maximum: retry only while ours is still the better one
+    packed = lookahead_pack(score, candidate);
+    best = __atomic_load_n(&round->best, __ATOMIC_RELAXED);
+    while (packed > best && !__atomic_compare_exchange_n(&round->best, &best, packed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&round->nodes, scratch->search.nodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&round->scored, 1, __ATOMIC_RELEASE);
+}
+
+// Aim for the best candidate scored so far. Returns 0, leaving the one-piece
+// target, if none was or the round is for an earlier piece.
+int bot_lookahead_finish(struct bot* bot, struct game* game, struct lookahead* round)
+{
+    uint32_t best = __atomic_load_n(&round->best, __ATOMIC_ACQUIRE);
+
+    bot->nodes += __atomic_load_n(&round->nodes, __ATOMIC_RELAXED);
+
+    if (!best || round->piece != game->pieces) return 0;
+
+    copy_tetrominoe(round->cells[255 - (best & 0xFF)], bot->target);
+    bot->piece = game->pieces;
+    bot->has_target = 1;
+
+    return 1;
+}
@@ -0,0 +1,161 @@
+// bot.h — autoplay: boards as row bitmasks and a heuristic evaluator
+// Freestanding like engine.c; linked into kernel.elf and libengine.a.
+
+#ifndef BOT_H
+#define BOT_H
+
+#include "engine.h"
+
+#define BOARD_FULL_ROW ((1 << GRID_SIZE_X) - 1)
+
+// The grid as one bit per cell: bit x of rows[y], row 0 at the top
+struct board
+{
+    uint16_t rows[GRID_SIZE_Y];
+    uint64_t hash; // Zobrist hash of the cells, see tt_init
+};
+
+// Evaluator features of a board. The weights use the same struct; a score is
+// the sum of feature times weight, and higher is better.
+struct eval_terms
+{
+    int height;          // Aggregate column height
+    int holes;           // Empty cells with a filled cell somewhere above
+    int bumpiness;       // Height differences between neighbouring columns
+    int row_transitions; // Filled/empty changes along each row, walls filled
+    int col_transitions; // Filled/empty changes down each column, floor filled
+    int wells;           // Open cells with both neighbours filled or wall
+    int lines;           // Lines the last placement cleared
+};
+
+extern const struct eval_terms eval_default_weights;
+
+void zobrist_init(void); // Once, before the first board is made
+uint64_t board_hash(const struct board* board);
+void board_from_grid(struct board* board, int grid[GRID_SIZE_X][GRID_SIZE_Y], int tetrominoe[4][2]);
+int board_place(struct board* board, int tetrominoe[4][2]);
+void board_features(const struct board* board, int lines, struct eval_terms* features);
+int board_evaluate(const struct board* board, int lines, const struct eval_terms* weights);
+void board_evaluate_many(const struct board* boards, const int* lines, int count, const struct eval_terms* weights, int* scores);
+
+// Transposition table
+// Evaluations keyed by Zobrist hash, so a board reached again, by another
+// placement order or in a later search, is not scored twice. An entry is
+// two words, the data and the data XORed with the key's upper half; a
+// lookup only believes an entry whose words agree, so entries are written
+// without locks and a torn write reads as a miss. Entries come eight to a
+// 64-byte bucket, one cache line per lookup. Values hold for one set of
+// weights.
+#define TT_BUCKET_ENTRIES 8
+
+struct tt_entry
+{
+    uint32_t check;
+    uint32_t data;
+};
+
+struct tt_bucket
+{
+    struct tt_entry entries[TT_BUCKET_ENTRIES];
+} __attribute__((aligned(64)));
+
+struct tt
+{
+    struct tt_bucket* buckets;
+    uint32_t mask; // Buckets - 1
+};
+
+// Per user, so that no counter is shared between CPUs
+struct tt_stats
+{
+    uint32_t probes;
+    uint32_t hits;
+    uint32_t stores;
+    uint32_t evictions; // Stores that displaced another key's entry
+};
+
+void tt_init(struct tt* tt, void* memory, uint32_t bytes);
+int tt_probe(struct tt* tt, uint64_t key, int depth, int* score, struct tt_stats* stats);
+void tt_store(struct tt* tt, uint64_t key, int depth, int score, struct tt_stats* stats);
+
+// Autoplay: pick the best placement for each piece and feed the inputs that
+// lead there, one at a time, so it can drive the real game through its keys
+struct bot
+{
+    const struct eval_terms* weights;
+    struct placement_search search;
+    struct placement placements[PLACEMENT_MAX];
+    struct board boards[PLACEMENT_MAX];
+    int lines[PLACEMENT_MAX];
+    int scores[PLACEMENT_MAX];
+    int count;          // Placements bot_choose scored
+    int target[4][2];   // Cells the current piece is headed for
+    int best;           // Index of the route to the target in placements
+    uint32_t piece;     // game->pieces when the target was chosen
+    int has_target;
+    uint32_t choices;   // Targets chosen, one per piece
+    uint64_t nodes;     // Search states expanded, for nodes per second
+    uint32_t truncated; // Placements left out for too long a route
+    struct tt* tt;      // Optional, for the lookahead
+};
+
+void bot_init(struct bot* bot, const struct eval_terms* weights);
+int bot_choose(struct bot* bot, struct game* game);
+char bot_next_input(struct bot* bot, struct game* game);
+
+// How bot_play_turn presses the game's keys, so that attract mode and the
+// host tools feed the bot's inputs the same way. Keys are 'L', 'R', 'U'
+// (rotate) and 'D' (down).
+#define BOT_BURST_TICKS 16 // Rows falling faster than this: no pacing
+
+struct bot_keys
+{
+    void (*set_key)(void* ctx, char key, int pressed);
+    void (*pause)(void* ctx); // Between the moves of a burst, may be 0
+    void* ctx;
+    uint32_t held;            // game->pieces + 1 while down is held for a drop
+};
+
+void bot_play_turn(struct bot* bot, struct game* game, struct bot_keys* keys, int speed);
+
+// Two-piece lookahead: each placement of the piece in play (a candidate) is
+// scored by the best placement of the next piece on the board it leaves.
+// Candidates are handed out one at a time from a shared counter and the
+// best result is kept in one packed word, so any number of CPUs can work on
+// a round at once and stop whenever their time is up.
+struct lookahead_scratch
+{
+    struct placement_search search;
+    struct placement placements[PLACEMENT_MAX];
+    struct board boards[PLACEMENT_MAX];
+    int lines[PLACEMENT_MAX];
+    int scores[PLACEMENT_MAX];
+    int grid[GRID_SIZE_X][GRID_SIZE_Y];
+    int tetrominoe[4][2];
+    struct tt_stats tt_stats;
+};
+
+struct lookahead
+{
+    const struct eval_terms* weights;
+    struct tt* tt;                      // 0 to score everything afresh
+    struct board boards[PLACEMENT_MAX]; // After each candidate
+    int lines[PLACEMENT_MAX];
+    int cells[PLACEMENT_MAX][4][2];
+    uint8_t order[PLACEMENT_MAX];       // Best one-piece score first
+    int count;
+    int type;                           // The piece in play
+    int next;                           // The next piece's type
+    uint32_t piece;                     // game->pieces the round is for
+    volatile uint32_t claimed;          // Candidates handed out
+    volatile uint32_t scored;           // Candidates finished
+    volatile uint32_t best;             // Packed score and candidate, 0 if none
+    volatile uint32_t nodes;            // Search states expanded
+};
+
+int bot_lookahead_start(struct bot* bot, struct game* game, struct lookahead* round);
+int lookahead_claim(struct lookahead* round);
+void lookahead_score(struct lookahead* round, int candidate, struct lookahead_scratch* scratch);
+int bot_lookahead_finish(struct bot* bot, struct game* game, struct lookahead* round);
+
+#endif
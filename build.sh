@@ -1,12 +1,97 @@
 #!/bin/bash
 
+# LZ4=0 ./build.sh puts the kernel in boot.img uncompressed
+LZ4=${LZ4:-1}
+# PAGING=0 ./build.sh runs the kernel with paging off
+PAGING=${PAGING:-1}
+# PROFILE=debug|speed|size|lto ./build.sh picks the optimisation (speed, -O2,
+# by default). MARCH=i686 or MARCH=pentium4 (SSE2) tunes for, and then
+# requires, that CPU.
+PROFILE=${PROFILE:-speed}
+MARCH=${MARCH:-}
+
+case $PROFILE in
+    debug) OPT="-O0 -g" ;;
+    speed) OPT="-O2" ;;
+    size)  OPT="-Os" ;;
+    lto)   OPT="-O2 -flto" ;;
+    *)     echo "unknown PROFILE $PROFILE (debug, speed, size or lto)"; exit 1 ;;
+esac
+
+if [ -n "$MARCH" ]; then
+    OPT="$OPT -march=$MARCH"
+fi
+
+# Freestanding: no libc builtins or stack protector, and no warnings about
+# the fixed low addresses (BIOS data, boot slots) the kernel reads
+CFLAGS="-m32 -ffreestanding -fno-builtin -fno-pic -fno-pie -fno-stack-protector \
+    -fno-asynchronous-unwind-tables --param=min-pagesize=0 -nostdlib $OPT"
+
+# LTO needs the compiler driver to link, so that the IR is compiled at link time
+link_kernel()
+{
+    local out=$1
+    shift
+
+    if [ "$PROFILE" = "lto" ]; then
+        gcc $CFLAGS -no-pie -Wl,-m,elf_i386 -Wl,--build-id=none -T linker.ld "$@" -o $out
+    else
+        ld -m elf_i386 -T linker.ld -nostdlib "$@" -o $out
+    fi
+}
+
 nasm -f bin loader.asm -o loader.bin
 nasm -f elf32 kernel_entry.asm -o kernel_entry.o
 nasm -f elf32 isr_stub.asm -o isr_stub.o
-gcc -m32 -ffreestanding -fno-pic -fno-pie -nostdlib -c kernel.c -o kernel.o
-ld -m elf_i386 -T linker.ld -nostdlib kernel_entry.o isr_stub.o kernel.o -o kernel.elf
+nasm -f elf32 task_switch.asm -o task_switch.o
+nasm -f elf32 ap_trampoline.asm -o ap_trampoline.o
+gcc $CFLAGS -DPAGING=$PAGING -c kernel.c -o kernel.o
+gcc $CFLAGS -c engine.c -o engine.o
+gcc $CFLAGS -c bot.c -o bot.o
+link_kernel kernel.elf kernel_entry.o isr_stub.o task_switch.o ap_trampoline.o kernel.o engine.o bot.o
 objcopy -O binary kernel.elf kernel.bin
 
-cat loader.bin kernel.bin > boot.img
+echo "profile $PROFILE${MARCH:+, -march=$MARCH}"
+
+# Memory budget: sections and largest objects, and the image plus .bss must
+# end below the boot stack guard page (BOOT_STACK_GUARD in layout.h)
+size -A kernel.elf | awk '$1 ~ /^\.(text|rodata|data|note|bss)$/ { printf "%-8s %8d bytes\n", $1, $2 }'
+nm -S --size-sort -t d kernel.elf | tail -6 | awk '{ printf "  %-16s %8d bytes\n", $4, $2 }'
+
+stack_guard=$(( $(printf '#include "layout.h"\nBOOT_STACK_GUARD\n' | gcc -E -P -x c - | tail -1) ))
+kernel_end=$(( 0x$(nm kernel.elf | awk '$3 == "__kernel_end" { print $1 }') ))
+if [ $kernel_end -gt $stack_guard ]; then
+    printf "kernel ends at 0x%x, past the boot stack guard at 0x%x\n" $kernel_end $stack_guard
+    exit 1
+fi
+echo "$(( stack_guard - kernel_end )) bytes free below the boot stack guard"
+
+payload=kernel.bin
+
+if [ "$LZ4" != "0" ]; then
+    if command -v lz4 > /dev/null; then
+        lz4 -l -9 -f -q kernel.bin kernel.lz4
+        nasm -f bin lz4_stub.asm -o kernel_lz4.bin
+        payload=kernel_lz4.bin
+    else
+        echo "lz4 not found, building an uncompressed image"
+    fi
+fi
+
+cat loader.bin $payload > boot.img
 
 truncate -s 1474560 boot.img
+
+# bench.img: the same kernel built with BENCH_MODE, runs the in-guest
+# benchmarks and exits QEMU (see tools/bench.sh). Stored uncompressed.
+gcc $CFLAGS -DPAGING=$PAGING -DBENCH_MODE=1 -c kernel.c -o kernel_bench.o
+link_kernel kernel_bench.elf kernel_entry.o isr_stub.o task_switch.o ap_trampoline.o kernel_bench.o engine.o bot.o
+objcopy -O binary kernel_bench.elf kernel_bench.bin
+cat loader.bin kernel_bench.bin > bench.img
+truncate -s 1474560 bench.img
+
+# Size report: what the loader has to read at boot
+for f in kernel.bin $payload; do
+    size=$(stat -c %s $f)
+    echo "$f: $size bytes, $(( (size + 511) / 512 )) sectors"
+done | uniq
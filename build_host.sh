@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Build the game engine for the host: libengine.a, the native runner, the
+# microbenchmarks, the headless simulator and the differential tester.
+# CC=clang ./build_host.sh to pick the compiler.
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -Wall}
+
+set -e
+
+$CC $CFLAGS -c engine.c -o engine_host.o
+$CC $CFLAGS -c bot.c -o bot_host.o
+ar rcs libengine.a engine_host.o bot_host.o
+$CC $CFLAGS -pthread host/engine_runner.c libengine.a -o engine_runner
+$CC $CFLAGS host/engine_bench.c libengine.a -o engine_bench
+$CC $CFLAGS host/engine_sim.c libengine.a -o engine_sim
+$CC $CFLAGS host/engine_diff.c host/engine_ref.c libengine.a -o engine_diff
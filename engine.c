@@ -0,0 +1,928 @@
+// engine.c — the game rules: pieces, collisions, line clears, scoring and the
+// per-tick state machine. Freestanding: no libc, no port I/O, no VRAM; time
+// and display go through the hal_* functions in engine.h.
+
+#include "engine.h"
+
+// Seed the piece generator. A zero seed would stick at zero, so it is bumped.
+void engine_seed(struct game* game, uint32_t seed)
+{
+    game->rng = seed ? seed : 0x2545F491;
+}
+
+// xorshift32
+uint32_t engine_rand(struct game* game)
+{
+    uint32_t x = game->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    game->rng = x;
+
+    return x;
+}
+
+int check_tetrominoe_collision(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y])
+{
+    return tetrominoe[0][0] >= 0 && tetrominoe[0][0] < GRID_SIZE_X
+        && tetrominoe[0][1] >= 0 && tetrominoe[0][1] < GRID_SIZE_Y
+        && tetrominoe[1][0] >= 0 && tetrominoe[1][0] < GRID_SIZE_X
+        && tetrominoe[1][1] >= 0 && tetrominoe[1][1] < GRID_SIZE_Y
+        && tetrominoe[2][0] >= 0 && tetrominoe[2][0] < GRID_SIZE_X
+        && tetrominoe[2][1] >= 0 && tetrominoe[2][1] < GRID_SIZE_Y
+        && tetrominoe[3][0] >= 0 && tetrominoe[3][0] < GRID_SIZE_X
+        && tetrominoe[3][1] >= 0 && tetrominoe[3][1] < GRID_SIZE_Y
+        && !grid[tetrominoe[0][0]][tetrominoe[0][1]]
+        && !grid[tetrominoe[1][0]][tetrominoe[1][1]]
+        && !grid[tetrominoe[2][0]][tetrominoe[2][1]]
+        && !grid[tetrominoe[3][0]][tetrominoe[3][1]];
+}
+
+void setup_tetrominoe(int tetrominoe[4][2], int piece, int offset_x)
+{
+    switch (piece) {
+        case PIECE_LINE:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 1;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 2;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 3;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_L:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 0;
+            break;
+
+        case PIECE_REVERSE_L:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 0;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 0;
+            break;
+
+        case PIECE_SQUARE:
+            tetrominoe[0][0] = offset_x + 1;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_5:
+            tetrominoe[0][0] = offset_x + 1;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 0;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 1;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_S:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_T:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 2;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 1;
+            tetrominoe[3][1] = 1;
+            break;
+    }
+}
+
+int create_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+{
+    setup_tetrominoe(tetrominoe, piece, 4);
+
+    if (check_tetrominoe_collision(tetrominoe, grid)) {
+        grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
+        grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
+        grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
+        grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void create_next_tetrominoe(int tetrominoe[4][2], int grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+{
+    setup_tetrominoe(tetrominoe, piece, 0);
+
+    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
+        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
+            grid[x][y] = 0;
+        }
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+}
+
+void copy_tetrominoe(int src_tetrominoe[4][2], int dst_tetrominoe[4][2])
+{
+    dst_tetrominoe[0][0] = src_tetrominoe[0][0];
+    dst_tetrominoe[0][1] = src_tetrominoe[0][1];
+    dst_tetrominoe[1][0] = src_tetrominoe[1][0];
+    dst_tetrominoe[1][1] = src_tetrominoe[1][1];
+    dst_tetrominoe[2][0] = src_tetrominoe[2][0];
+    dst_tetrominoe[2][1] = src_tetrominoe[2][1];
+    dst_tetrominoe[3][0] = src_tetrominoe[3][0];
+    dst_tetrominoe[3][1] = src_tetrominoe[3][1];
+}
+
+int move_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int direction)
+{
+    int moved = 0;
+    int new_tetrominoe[4][2];
+    short block_colour;
+
+    copy_tetrominoe(tetrominoe, new_tetrominoe);
+
+    switch (direction) {
+        case MOVE_DOWN:
+            new_tetrominoe[0][1]++;
+            new_tetrominoe[1][1]++;
+            new_tetrominoe[2][1]++;
+            new_tetrominoe[3][1]++;
+            break;
+        case MOVE_LEFT:
+            new_tetrominoe[0][0]--;
+            new_tetrominoe[1][0]--;
+            new_tetrominoe[2][0]--;
+            new_tetrominoe[3][0]--;
+            break;
+        case MOVE_RIGHT:
+            new_tetrominoe[0][0]++;
+            new_tetrominoe[1][0]++;
+            new_tetrominoe[2][0]++;
+            new_tetrominoe[3][0]++;
+            break;
+    }
+
+    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+
+    if (check_tetrominoe_collision(new_tetrominoe, grid)) {
+        copy_tetrominoe(new_tetrominoe, tetrominoe);
+        moved = 1;
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
+
+    return moved;
+}
+
+// Where a quarter turn would put the piece, ignoring the grid. The turn is
+// about the corner of the bounding box, so pieces drift as they rotate.
+static void rotated_tetrominoe(int tetrominoe[4][2], int new_tetrominoe[4][2], int type)
+{
+    int temp_tetrominoe[4][2];
+    int lowest_x;
+    int lowest_y;
+    int max_ext;
+
+    lowest_x = tetrominoe[0][0];
+    if (lowest_x > tetrominoe[1][0]) lowest_x = tetrominoe[1][0];
+    if (lowest_x > tetrominoe[2][0]) lowest_x = tetrominoe[2][0];
+    if (lowest_x > tetrominoe[3][0]) lowest_x = tetrominoe[3][0];
+
+    lowest_y = tetrominoe[0][1];
+    if (lowest_y > tetrominoe[1][1]) lowest_y = tetrominoe[1][1];
+    if (lowest_y > tetrominoe[2][1]) lowest_y = tetrominoe[2][1];
+    if (lowest_y > tetrominoe[3][1]) lowest_y = tetrominoe[3][1];
+
+    temp_tetrominoe[0][0] = tetrominoe[0][0] - lowest_x;
+    temp_tetrominoe[1][0] = tetrominoe[1][0] - lowest_x;
+    temp_tetrominoe[2][0] = tetrominoe[2][0] - lowest_x;
+    temp_tetrominoe[3][0] = tetrominoe[3][0] - lowest_x;
+    temp_tetrominoe[0][1] = tetrominoe[0][1] - lowest_y;
+    temp_tetrominoe[1][1] = tetrominoe[1][1] - lowest_y;
+    temp_tetrominoe[2][1] = tetrominoe[2][1] - lowest_y;
+    temp_tetrominoe[3][1] = tetrominoe[3][1] - lowest_y;
+
+    switch (type) {
+        case PIECE_LINE:
+            max_ext = 4;
+            break;
+
+        case PIECE_L:
+            max_ext = 3;
+            break;
+
+        case PIECE_REVERSE_L:
+            max_ext = 3;
+            break;
+
+        case PIECE_SQUARE:
+            max_ext = 2;
+            break;
+
+        case PIECE_5:
+            max_ext = 3;
+            break;
+
+        case PIECE_S:
+            max_ext = 3;
+            break;
+
+        case PIECE_T:
+        default:
+            max_ext = 3;
+            break;
+    }
+
+    new_tetrominoe[0][0] = temp_tetrominoe[0][1];
+    new_tetrominoe[0][1] = 1-(temp_tetrominoe[0][0]-(max_ext-2));
+    new_tetrominoe[1][0] = temp_tetrominoe[1][1];
+    new_tetrominoe[1][1] = 1-(temp_tetrominoe[1][0]-(max_ext-2));
+    new_tetrominoe[2][0] = temp_tetrominoe[2][1];
+    new_tetrominoe[2][1] = 1-(temp_tetrominoe[2][0]-(max_ext-2));
+    new_tetrominoe[3][0] = temp_tetrominoe[3][1];
+    new_tetrominoe[3][1] = 1-(temp_tetrominoe[3][0]-(max_ext-2));
+
+    new_tetrominoe[0][0] = new_tetrominoe[0][0] + lowest_x;
+    new_tetrominoe[1][0] = new_tetrominoe[1][0] + lowest_x;
+    new_tetrominoe[2][0] = new_tetrominoe[2][0] + lowest_x;
+    new_tetrominoe[3][0] = new_tetrominoe[3][0] + lowest_x;
+    new_tetrominoe[0][1] = new_tetrominoe[0][1] + lowest_y;
+    new_tetrominoe[1][1] = new_tetrominoe[1][1] + lowest_y;
+    new_tetrominoe[2][1] = new_tetrominoe[2][1] + lowest_y;
+    new_tetrominoe[3][1] = new_tetrominoe[3][1] + lowest_y;
+}
+
+void rotate_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type)
+{
+    int new_tetrominoe[4][2];
+    short block_colour;
+
+    rotated_tetrominoe(tetrominoe, new_tetrominoe, type);
+
+    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+
+    if (check_tetrominoe_collision(new_tetrominoe, grid)) {
+        copy_tetrominoe(new_tetrominoe, tetrominoe);
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
+}
+
+int get_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    int remove_count = 0;
+
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if (!grid[x][y]) {
+                goto next_line;
+            }
+        }
+
+        remove_lines[remove_count++] = y;
+
+        next_line:
+        continue;
+    }
+
+    return remove_count;
+}
+
+void cycle_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    for (int i = 0; i < 4; i++) {
+        if (remove_lines[i] == -1) { continue; }
+
+        // Cycle the line
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if ((grid[x][remove_lines[i]] & 0x00FF) == '#') {
+                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] & 0xFF20;
+            } else {
+                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] | '#';
+            }
+        }
+    }
+}
+
+int do_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    int remove_count = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (remove_lines[i] == -1) { continue; }
+
+        remove_count++;
+
+        // Remove the line
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            grid[x][remove_lines[i]] = 0;
+        }
+
+        // Move above lines down
+        for (int y = remove_lines[i]; y != 0; y--) {
+            for (int x = 0; x < GRID_SIZE_X; x++) {
+                grid[x][y] = grid[x][y-1];
+            }
+        }
+
+        remove_lines[i] = -1;
+    }
+
+    return remove_count;
+}
+
+// Award points for lines cleared at once, and level up every ten lines
+void score_lines(struct game* game, int lines_removed)
+{
+    game->lines += lines_removed;
+    if (game->lines > 9999) { game->lines = 9999; }
+
+    switch (lines_removed) {
+        case 1:
+            game->score += 40 * (game->level + 1);
+            break;
+
+        case 2:
+            game->score += 100 * (game->level + 1);
+            break;
+
+        case 3:
+            game->score += 300 * (game->level + 1);
+            break;
+
+        case 4:
+            game->score += 1200 * (game->level + 1);
+            break;
+    }
+
+    if (game->score > 99999999) { game->score = 99999999; }
+
+    if (game->level != 9 && game->lines >= (game->level * 10) + 10) {
+        game->level++;
+        game->fall_delay -= 10;
+    }
+}
+
+void game_init(struct game* game, uint32_t seed)
+{
+    game->quit = 0;
+    game->restart = 0;
+    game->pause = 0;
+    game->left = 0;
+    game->right = 0;
+    game->up = 0;
+    game->down = 0;
+    game->key_pressed = 0;
+    game->down_pressed = 0;
+
+    game->state = STATE_DESCEND;
+    game->flash_lines_count = 0;
+    game->lines = 0;
+    game->level = 0;
+    game->score = 0;
+    game->fall_delay = INITIAL_FALL_DELAY;
+
+    game->next = -1;
+    game->pieces = 0;
+    game->remove_lines[0] = -1;
+    game->remove_lines[1] = -1;
+    game->remove_lines[2] = -1;
+    game->remove_lines[3] = -1;
+
+    game->last_move = hal_ticks();
+    engine_seed(game, seed);
+
+    for (int i = 0; i < 10; i++) {
+        game->numbers[i] = '0' + i;
+    }
+
+    // Light gray
+    game->block_colours[0] = 0x0700;
+
+    // Red
+    game->block_colours[1] = 0x0400;
+
+    // Green
+    game->block_colours[2] = 0x0200;
+
+    // Blue
+    game->block_colours[3] = 0x0100;
+
+    // Magenta
+    game->block_colours[4] = 0x0500;
+
+    // Yellow
+    game->block_colours[5] = 0x0E00;
+
+    // Cyan
+    game->block_colours[6] = 0x0300;
+
+    // Clear the grid
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            game->grid[x][y] = 0;
+        }
+    }
+
+    // Clear the next grid
+    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
+        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
+            game->next_grid[x][y] = 0;
+        }
+    }
+}
+
+// Compose the playfield and the next-piece box into an 80x25 text frame of
+// VGA attribute/character cells
+void engine_render(struct game* game, short frame[2000])
+{
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            if (game->grid[x][y] == 0) {
+                frame[y*80+x+1] = 0x0700 | ' ';
+            } else if ((game->grid[x][y] & 0x00FF) == ' ') {
+                frame[y*80+x+1] = game->grid[x][y] | ' ';
+            } else {
+                frame[y*80+x+1] = game->grid[x][y] | '#';
+            }
+        }
+    }
+
+    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
+        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
+            if (game->next_grid[x][y] == 0) {
+                frame[(y+3)*80+x+GRID_SIZE_X+6] = 0x0700 | ' ';
+            } else {
+                frame[(y+3)*80+x+GRID_SIZE_X+6] = game->next_grid[x][y] | '#';
+            }
+        }
+    }
+}
+
+// Advance the game by one step: apply key state, then run the state machine
+void game_step(struct game* game)
+{
+    uint64_t now;
+    uint64_t timediff;
+    int lines_removed;
+
+    if (game->next == -1) {
+        game->next = engine_rand(game) % 7;
+        create_next_tetrominoe(game->next_tetrominoe, game->next_grid, game->block_colours, game->next);
+    }
+
+    if (!game->left && !game->right && !game->up && !game->down && !game->pause) {
+        game->key_pressed = 0;
+    }
+
+    if (!game->down) {
+        game->down_pressed = 0;
+    }
+
+    if (game->state == STATE_DESCEND && !game->key_pressed && (game->left || game->right || game->up || game->down || game->pause)) {
+        if (game->left) { move_tetrominoe(game->tetrominoe, game->grid, MOVE_LEFT); }
+        if (game->right) { move_tetrominoe(game->tetrominoe, game->grid, MOVE_RIGHT); }
+        if (game->down) { game->down_pressed = 1; }
+        if (game->up) { rotate_tetrominoe(game->tetrominoe, game->grid, game->current); }
+        if (game->pause) { game->state = STATE_PAUSED; }
+
+        game->key_pressed = 1;
+    } else if (game->state == STATE_PAUSED && !game->key_pressed && game->pause) {
+        game->state = STATE_DESCEND;
+        hal_show_state(game);
+
+        game->key_pressed = 1;
+    }
+
+    now = hal_ticks();
+    timediff = now - game->last_move;
+
+    switch (game->state) {
+        case STATE_CREATE_PIECE:
+            if (create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->next)) {
+                game->current = game->next;
+                game->next = -1;
+                game->pieces++;
+                game->state = STATE_DESCEND;
+                game->down_pressed = 0;
+            } else {
+                game->state = STATE_GAME_OVER;
+            }
+
+            break;
+
+        case STATE_DESCEND:
+            if (timediff > (game->down_pressed ? DROP_FALL_DELAY : game->fall_delay)) {
+                if (!move_tetrominoe(game->tetrominoe, game->grid, MOVE_DOWN)) {
+                    if (get_remove_lines(game->grid, game->remove_lines) > 0) {
+                        game->state = STATE_ROW_FLASH;
+                    } else {
+                        game->state = STATE_CREATE_PIECE;
+                    }
+                }
+
+                game->last_move = now;
+            }
+
+            break;
+
+        case STATE_ROW_FLASH:
+            if (timediff > 10) {
+                if (game->flash_lines_count < 4) {
+                    cycle_remove_lines(game->grid, game->remove_lines);
+                    game->flash_lines_count++;
+                } else {
+                    game->flash_lines_count = 0;
+                    game->state = STATE_ROW_REMOVE;
+                }
+
+                game->last_move = now;
+            }
+
+            break;
+
+        case STATE_ROW_REMOVE:
+            lines_removed = do_remove_lines(game->grid, game->remove_lines);
+            score_lines(game, lines_removed);
+            hal_show_counters(game);
+
+            game->state = STATE_CREATE_PIECE;
+
+            break;
+
+        case STATE_GAME_OVER:
+            hal_show_state(game);
+
+            break;
+
+        case STATE_PAUSED:
+            hal_show_state(game);
+
+            break;
+    }
+}
+
+// Headless simulation
+// Whole pieces at a time, for playing games much faster than real time: no
+// ticks, no row flashing, no hal_show_* calls. The rules and the piece
+// sequence are the same as game_step's, so a seed gives the same pieces in
+// both.
+
+// Start a game the way tetris() does: first piece in play, next one chosen
+void sim_start(struct game* game, uint32_t seed)
+{
+    game_init(game, seed);
+
+    game->current = engine_rand(game) % 7;
+    create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->current);
+
+    game->next = engine_rand(game) % 7;
+    create_next_tetrominoe(game->next_tetrominoe, game->next_grid, game->block_colours, game->next);
+}
+
+// Rotate the current piece, shift it (negative is left), drop it, clear and
+// score full rows, then spawn the next piece. Blocked moves are skipped as
+// they are for a player. Returns the lines cleared, or -1 once the game is
+// over.
+int sim_place(struct game* game, int rotations, int shift)
+{
+    int lines_removed = 0;
+
+    if (game->state == STATE_GAME_OVER) {
+        return -1;
+    }
+
+    for (int i = 0; i < rotations; i++) {
+        rotate_tetrominoe(game->tetrominoe, game->grid, game->current);
+    }
+
+    for (; shift < 0; shift++) {
+        if (!move_tetrominoe(game->tetrominoe, game->grid, MOVE_LEFT)) break;
+    }
+
+    for (; shift > 0; shift--) {
+        if (!move_tetrominoe(game->tetrominoe, game->grid, MOVE_RIGHT)) break;
+    }
+
+    while (move_tetrominoe(game->tetrominoe, game->grid, MOVE_DOWN));
+
+    if (get_remove_lines(game->grid, game->remove_lines) > 0) {
+        lines_removed = do_remove_lines(game->grid, game->remove_lines);
+        score_lines(game, lines_removed);
+    }
+
+    if (!create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->next)) {
+        game->state = STATE_GAME_OVER;
+
+        return -1;
+    }
+
+    game->current = game->next;
+    game->pieces++;
+    game->next = engine_rand(game) % 7;
+    create_next_tetrominoe(game->next_tetrominoe, game->next_grid, game->block_colours, game->next);
+
+    return lines_removed;
+}
+
+void sim_stats_init(struct sim_stats* stats)
+{
+    stats->games = 0;
+    stats->pieces = 0;
+    stats->lines = 0;
+    stats->score_total = 0;
+    stats->score_min = 0x7FFFFFFF;
+    stats->score_max = 0;
+
+    for (int i = 0; i < SIM_SCORE_BUCKETS; i++) {
+        stats->score_hist[i] = 0;
+    }
+}
+
+// Play one game to the end, or for max_pieces pieces (0 for no limit), asking
+// the policy where each piece goes, and add it to stats. A null policy just
+// drops every piece where it spawns.
+void sim_game(struct game* game, uint32_t seed, uint32_t max_pieces, sim_policy policy, void* ctx, struct sim_stats* stats)
+{
+    uint32_t pieces = 0;
+    int rotations;
+    int shift;
+    int bucket = 0;
+
+    sim_start(game, seed);
+
+    while (!max_pieces || pieces < max_pieces) {
+        rotations = 0;
+        shift = 0;
+
+        if (policy && !policy(game, &rotations, &shift, ctx)) break;
+
+        pieces++;
+        if (sim_place(game, rotations, shift) < 0) break;
+    }
+
+    for (int score = game->score; score; score >>= 1) {
+        bucket++;
+    }
+
+    stats->games++;
+    stats->pieces += pieces;
+    stats->lines += game->lines;
+    stats->score_total += game->score;
+    if (game->score < stats->score_min) stats->score_min = game->score;
+    if (game->score > stats->score_max) stats->score_max = game->score;
+    stats->score_hist[bucket]++;
+}
+
+// Random rotation and shift for every piece. ctx is the policy's own
+// xorshift32 state (non-zero), so it does not disturb the piece sequence.
+int sim_policy_random(struct game* game, int* rotations, int* shift, void* ctx)
+{
+    uint32_t* rng = ctx;
+    uint32_t x = *rng;
+
+    (void)game;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+
+    *rotations = x & 3;
+    *shift = (int)((x >> 2) % GRID_SIZE_X) - GRID_SIZE_X / 2;
+
+    return 1;
+}
+
+// Placement search
+// Breadth-first search over every state the current piece can reach one
+// move or quarter turn at a time, as a player would make them. A state is
+// (orientation, left column, top row): rotate_tetrominoe always turns a
+// given shape the same way, so the orientation fixes the cells relative to
+// the corner, and a turn moves the corner by a fixed amount. Orientations
+// with the same shape (the square's four, the line's two) are one state.
+
+#define SEARCH_STATE(r, x, y) (((r) * GRID_SIZE_Y + (y)) * GRID_SIZE_X + (x))
+#define SEARCH_ROOT 0xFFFF
+
+static const char search_inputs[4] = { 'L', 'R', 'D', 'U' };
+
+static void tetrominoe_corner(int tetrominoe[4][2], int* x, int* y)
+{
+    *x = tetrominoe[0][0];
+    *y = tetrominoe[0][1];
+
+    for (int i = 1; i < 4; i++) {
+        if (*x > tetrominoe[i][0]) *x = tetrominoe[i][0];
+        if (*y > tetrominoe[i][1]) *y = tetrominoe[i][1];
+    }
+}
+
+// Same cells in any order
+int same_cells(int a[4][2], int b[4][2])
+{
+    for (int i = 0; i < 4; i++) {
+        int found = 0;
+
+        for (int j = 0; j < 4; j++) {
+            found |= a[i][0] == b[j][0] && a[i][1] == b[j][1];
+        }
+
+        if (!found) return 0;
+    }
+
+    return 1;
+}
+
+// Enumerate the distinct resting places of the piece (cells it would lock
+// in) reachable from where it is, each with its shortest input sequence.
+// grid holds the piece, as the game keeps it; it is not modified. search is
+// scratch space, so one per thread. Returns the number of placements, at
+// most max, in order of input length. Placements whose shortest route is
+// longer than PLACEMENT_MAX_INPUTS are left out and counted in
+// search->truncated, so a caller can tell the list is incomplete.
+int find_placements(struct placement_search* search, int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type, struct placement* placements, int max)
+{
+    int shapes[4][4][2];
+    uint32_t masks[4][4];
+    int turn_x[4];
+    int turn_y[4];
+    int same_shape[4];
+    int cells[4][2];
+    int turned[4][2];
+    int head = 0;
+    int tail = 0;
+    int count = 0;
+    int x;
+    int y;
+
+    search->nodes = 0;
+    search->truncated = 0;
+    if (max <= 0) return 0;
+
+    // The grid without the piece as one bit per cell, walls and floor set,
+    // so a collision test is four ANDs
+    for (y = 0; y < GRID_SIZE_Y + SEARCH_FLOOR_ROWS; y++) {
+        search->rows[y] = y < GRID_SIZE_Y ? ~((1u << GRID_SIZE_X) - 1) : ~0u;
+    }
+    for (x = 0; x < GRID_SIZE_X; x++) {
+        for (y = 0; y < GRID_SIZE_Y; y++) {
+            if (grid[x][y]) search->rows[y] |= 1u << x;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        search->rows[tetrominoe[i][1]] &= ~(1u << tetrominoe[i][0]);
+    }
+
+    for (int i = 0; i < SEARCH_WORDS; i++) {
+        search->visited[i] = 0;
+    }
+
+    // Orientation 0 is the piece as it is, then a quarter turn each
+    copy_tetrominoe(tetrominoe, cells);
+    for (int r = 0; r < 4; r++) {
+        tetrominoe_corner(cells, &x, &y);
+
+        masks[r][0] = masks[r][1] = masks[r][2] = masks[r][3] = 0;
+        for (int i = 0; i < 4; i++) {
+            shapes[r][i][0] = cells[i][0] - x;
+            shapes[r][i][1] = cells[i][1] - y;
+            masks[r][shapes[r][i][1]] |= 1u << shapes[r][i][0];
+        }
+
+        rotated_tetrominoe(cells, turned, type);
+        tetrominoe_corner(turned, &turn_x[r], &turn_y[r]);
+        turn_x[r] -= x;
+        turn_y[r] -= y;
+        copy_tetrominoe(turned, cells);
+
+        same_shape[r] = r;
+        for (int s = 0; s < r; s++) {
+            if (same_cells(shapes[s], shapes[r])) {
+                same_shape[r] = s;
+                break;
+            }
+        }
+    }
+
+    tetrominoe_corner(tetrominoe, &x, &y);
+    search->queue[tail++] = SEARCH_STATE(0, x, y);
+    search->parent[SEARCH_STATE(0, x, y)] = SEARCH_ROOT;
+    search->visited[SEARCH_STATE(0, x, y) / 32] |= 1u << (SEARCH_STATE(0, x, y) % 32);
+
+    while (head < tail) {
+        int state = search->queue[head++];
+        int r = state / (GRID_SIZE_X * GRID_SIZE_Y);
+
+        x = state % GRID_SIZE_X;
+        y = state / GRID_SIZE_X % GRID_SIZE_Y;
+
+        for (int move = 0; move < 4; move++) {
+            int nr = r;
+            int nx = x;
+            int ny = y;
+            int next;
+
+            switch (move) {
+                case 0: nx--; break;
+                case 1: nx++; break;
+                case 2: ny++; break;
+                case 3: nr = same_shape[(r + 1) & 3]; nx += turn_x[r]; ny += turn_y[r]; break;
+            }
+
+            if (nx < 0
+                || (masks[nr][0] << nx & search->rows[ny])
+                || (masks[nr][1] << nx & search->rows[ny + 1])
+                || (masks[nr][2] << nx & search->rows[ny + 2])
+                || (masks[nr][3] << nx & search->rows[ny + 3])) {
+                struct placement* p = &placements[count];
+                int inputs = 0;
+
+                // Blocked going down: the piece locks here
+                if (move != 2) continue;
+
+                for (int s = state; search->parent[s] != SEARCH_ROOT; s = search->parent[s] >> 2) {
+                    inputs++;
+                }
+                if (inputs > PLACEMENT_MAX_INPUTS) {
+                    search->truncated++;
+                    continue;
+                }
+
+                for (int i = 0; i < 4; i++) {
+                    p->tetrominoe[i][0] = shapes[r][i][0] + x;
+                    p->tetrominoe[i][1] = shapes[r][i][1] + y;
+                }
+                p->rotations = r;
+                p->inputs = inputs;
+                for (int s = state; search->parent[s] != SEARCH_ROOT; s = search->parent[s] >> 2) {
+                    p->input[--inputs] = search_inputs[search->parent[s] & 3];
+                }
+
+                if (++count == max) break;
+                continue;
+            }
+
+            next = SEARCH_STATE(nr, nx, ny);
+            if (search->visited[next / 32] & (1u << (next % 32))) continue;
+
+            search->visited[next / 32] |= 1u << (next % 32);
+            search->parent[next] = (uint16_t)(state << 2 | move);
+            search->queue[tail++] = next;
+        }
+
+        if (count == max) break;
+    }
+
+    search->nodes = head;
+
+    return count;
+}
@@ -0,0 +1,157 @@
+// engine.h — the game rules, shared by the kernel and host programs
+// engine.c only touches the struct game it is given and the HAL functions
+// below, so it builds freestanding (linked into kernel.elf) or hosted
+// (libengine.a, see build_host.sh).
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "stdint.h"
+
+#define GRID_SIZE_X 10
+#define GRID_SIZE_Y 20
+#define NEXT_GRID_SIZE_X 4
+#define NEXT_GRID_SIZE_Y 4
+
+#define PIECE_TYPES 7
+
+#define PIECE_LINE 0
+#define PIECE_L 1
+#define PIECE_REVERSE_L 2
+#define PIECE_SQUARE 3
+#define PIECE_5 4
+#define PIECE_S 5
+#define PIECE_T 6
+
+#define MOVE_DOWN 0
+#define MOVE_LEFT 1
+#define MOVE_RIGHT 2
+
+#define STATE_CREATE_PIECE 0
+#define STATE_DESCEND 1
+#define STATE_ROW_FLASH 2
+#define STATE_ROW_REMOVE 3
+#define STATE_GAME_OVER 4
+#define STATE_PAUSED 5
+
+#define INITIAL_FALL_DELAY 90
+#define DROP_FALL_DELAY 0
+
+// Everything about one game. The kernel keeps one, host programs as many as
+// they like.
+struct game
+{
+    int quit;
+    int restart;
+    int pause;
+    int left;
+    int right;
+    int up;
+    int down;
+    int key_pressed;
+    int down_pressed;
+
+    int state;
+    int flash_lines_count;
+    int lines;
+    int level;
+    int score;
+    int fall_delay;
+
+    int grid[GRID_SIZE_X][GRID_SIZE_Y];
+    int next_grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y];
+
+    int tetrominoe[4][2];
+    int next_tetrominoe[4][2];
+    int current;
+    int next;
+    int remove_lines[4];
+
+    uint64_t last_move;
+    uint32_t rng; // xorshift32 state, never 0
+    uint32_t pieces; // Pieces spawned after the first
+
+    short block_colours[PIECE_TYPES];
+    char numbers[10];
+};
+
+
+// Hardware abstraction: the platform provides these. kernel.c implements them
+// on the PIT and VGA; host programs bring their own.
+uint64_t hal_ticks(void);                // Time in game ticks (10 ms)
+void hal_show_counters(struct game* game); // Lines, level or score changed
+void hal_show_state(struct game* game);    // Paused, unpaused or game over
+
+void engine_seed(struct game* game, uint32_t seed);
+uint32_t engine_rand(struct game* game);
+
+int check_tetrominoe_collision(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y]);
+void setup_tetrominoe(int tetrominoe[4][2], int piece, int offset_x);
+int create_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece);
+void create_next_tetrominoe(int tetrominoe[4][2], int grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece);
+void copy_tetrominoe(int src_tetrominoe[4][2], int dst_tetrominoe[4][2]);
+int same_cells(int a[4][2], int b[4][2]); // Same cells in any order
+int move_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int direction);
+void rotate_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type);
+int get_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+void cycle_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+int do_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+void score_lines(struct game* game, int lines_removed);
+
+void game_init(struct game* game, uint32_t seed);
+void game_step(struct game* game);
+void engine_render(struct game* game, short frame[2000]);
+
+// Headless simulation: whole pieces at a time, no timing or display
+#define SIM_SCORE_BUCKETS 28 // Games by bit length of the score
+
+struct sim_stats
+{
+    uint32_t games;
+    uint64_t pieces;
+    uint64_t lines;
+    uint64_t score_total;
+    int score_min;
+    int score_max;
+    uint32_t score_hist[SIM_SCORE_BUCKETS];
+};
+
+// Where the current piece goes: *rotations quarter turns, then *shift columns
+// (negative is left). Return 0 to end the game.
+typedef int (*sim_policy)(struct game* game, int* rotations, int* shift, void* ctx);
+
+void sim_start(struct game* game, uint32_t seed);
+int sim_place(struct game* game, int rotations, int shift);
+void sim_stats_init(struct sim_stats* stats);
+void sim_game(struct game* game, uint32_t seed, uint32_t max_pieces, sim_policy policy, void* ctx, struct sim_stats* stats);
+int sim_policy_random(struct game* game, int* rotations, int* shift, void* ctx);
+
+// Placement search: where the current piece can come to rest, and how
+#define SEARCH_STATES (4 * GRID_SIZE_X * GRID_SIZE_Y) // Orientation, column, row
+#define SEARCH_WORDS ((SEARCH_STATES + 31) / 32)
+#define SEARCH_FLOOR_ROWS 8 // Solid rows below the grid; a turn can reach 3 + 3 down
+#define PLACEMENT_MAX 128       // Plenty for real boards; the search stops at max
+#define PLACEMENT_MAX_INPUTS 48 // Longer routes are left out and counted in truncated
+
+struct placement
+{
+    int tetrominoe[4][2];            // Cells the piece locks in
+    int rotations;                   // Quarter turns from where it started
+    int inputs;
+    char input[PLACEMENT_MAX_INPUTS]; // L, R, D (down a row) and U (rotate)
+};
+
+// Scratch space for find_placements, about 3.4 KB
+struct placement_search
+{
+    uint32_t rows[GRID_SIZE_Y + SEARCH_FLOOR_ROWS]; // Occupied cells, bit x of row y
+    uint32_t visited[SEARCH_WORDS];
+    uint16_t queue[SEARCH_STATES];
+    uint16_t parent[SEARCH_STATES]; // Previous state << 2 | input
+    uint32_t nodes;                 // States the last search expanded
+    uint32_t truncated;             // Placements it left out for a route too long to store
+};
+
+int find_placements(struct placement_search* search, int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type, struct placement* placements, int max);
+
+#endif
@@ -0,0 +1,353 @@
+// engine_bench.c — microbenchmarks for the engine primitives
+// Build with ./build_host.sh, then: ./engine_bench [iterations] [seed]
+//
+// Every benchmark runs over seeded random boards at several fill levels and
+// prints one key=value line, e.g.
+//   bench=collision fill=50 ops=1000000 ns_per_op=2.41 cycles_per_op=7.9
+// so that two runs can be diffed or fed to a script. Benchmarks that must
+// restore the board between operations include a grid copy; grid_copy
+// measures that on its own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../engine.h"
+#include "../bot.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define read_cycles() __rdtsc()
+#else
+#define read_cycles() 0ULL
+#endif
+
+#define FIXTURES 64
+#define PROBES 16
+#define REPEATS 5
+
+uint64_t hal_ticks(void)
+{
+    return 0;
+}
+
+void hal_show_counters(struct game* game)
+{
+    (void)game;
+}
+
+void hal_show_state(struct game* game)
+{
+    (void)game;
+}
+
+// One board: a partly filled grid with a piece resting on it, a piece
+// still at the top, and some placements to probe for collisions
+struct fixture
+{
+    struct game game;
+    int falling[4][2];
+    int falling_type;
+    int resting[4][2];
+    int probes[PROBES][4][2];
+    int full_grid[GRID_SIZE_X][GRID_SIZE_Y]; // Same board with full rows
+};
+
+static struct fixture fixtures[FIXTURES];
+static int work_grid[GRID_SIZE_X][GRID_SIZE_Y];
+static short frame[2000];
+static volatile int sink;
+static uint32_t rng;
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+
+    return rng;
+}
+
+static void place(int grid[GRID_SIZE_X][GRID_SIZE_Y], int tetrominoe[4][2], int colour)
+{
+    for (int i = 0; i < 4; i++) {
+        grid[tetrominoe[i][0]][tetrominoe[i][1]] = colour;
+    }
+}
+
+// Fill the bottom fill% of rows at random, leaving a hole in every row
+static void build_fixture(struct fixture* fx, int fill)
+{
+    struct game* game = &fx->game;
+    int rows = GRID_SIZE_Y * fill / 100;
+
+    game_init(game, next_random());
+
+    for (int y = GRID_SIZE_Y - rows; y < GRID_SIZE_Y; y++) {
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if (next_random() % 5) {
+                game->grid[x][y] = game->block_colours[next_random() % PIECE_TYPES];
+            }
+        }
+        game->grid[next_random() % GRID_SIZE_X][y] = 0;
+    }
+
+    // Fill up to four of the partial rows for the line-removal benchmark
+    memcpy(fx->full_grid, game->grid, sizeof(fx->full_grid));
+    for (int i = 0; rows && i < 1 + (int)(next_random() % 4); i++) {
+        int y = GRID_SIZE_Y - 1 - next_random() % rows;
+
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            fx->full_grid[x][y] = game->block_colours[0];
+        }
+    }
+
+    for (int i = 0; i < PROBES; i++) {
+        setup_tetrominoe(fx->probes[i], next_random() % PIECE_TYPES, next_random() % (GRID_SIZE_X - 1));
+        for (int j = 0; j < 4; j++) {
+            fx->probes[i][j][1] += next_random() % (GRID_SIZE_Y - 1);
+        }
+    }
+
+    // Drop one piece to the bottom and leave it there, then spawn another
+    fx->falling_type = next_random() % PIECE_TYPES;
+    create_tetrominoe(fx->resting, game->grid, game->block_colours, fx->falling_type);
+    while (move_tetrominoe(fx->resting, game->grid, MOVE_DOWN));
+
+    fx->falling_type = next_random() % PIECE_TYPES;
+    create_tetrominoe(fx->falling, game->grid, game->block_colours, fx->falling_type);
+    move_tetrominoe(fx->falling, game->grid, MOVE_DOWN);
+    copy_tetrominoe(fx->falling, game->tetrominoe);
+
+    game->next = next_random() % PIECE_TYPES;
+    create_next_tetrominoe(game->next_tetrominoe, game->next_grid, game->block_colours, game->next);
+}
+
+static void bench_collision(long iters)
+{
+    int hits = 0;
+
+    for (long i = 0; i < iters; i++) {
+        struct fixture* fx = &fixtures[i % FIXTURES];
+        hits += check_tetrominoe_collision(fx->probes[(i / FIXTURES) % PROBES], fx->game.grid);
+    }
+
+    sink = hits;
+}
+
+// Left then right, two operations per round
+static void bench_move(long iters)
+{
+    int moved = 0;
+
+    for (long i = 0; i < iters; i += 2) {
+        struct fixture* fx = &fixtures[(i / 2) % FIXTURES];
+        moved += move_tetrominoe(fx->game.tetrominoe, fx->game.grid, MOVE_LEFT);
+        moved += move_tetrominoe(fx->game.tetrominoe, fx->game.grid, MOVE_RIGHT);
+    }
+
+    sink = moved;
+}
+
+// Rotations drift the piece, so put it back every full turn
+static void bench_rotate(long iters)
+{
+    for (long i = 0; i < iters; i++) {
+        struct fixture* fx = &fixtures[(i / 4) % FIXTURES];
+
+        rotate_tetrominoe(fx->game.tetrominoe, fx->game.grid, fx->falling_type);
+
+        if (i % 4 == 3) {
+            int colour = fx->game.grid[fx->game.tetrominoe[0][0]][fx->game.tetrominoe[0][1]];
+
+            place(fx->game.grid, fx->game.tetrominoe, 0);
+            copy_tetrominoe(fx->falling, fx->game.tetrominoe);
+            place(fx->game.grid, fx->game.tetrominoe, colour);
+        }
+    }
+}
+
+static void bench_line_detect(long iters)
+{
+    int lines = 0;
+    int remove_lines[4];
+
+    for (long i = 0; i < iters; i++) {
+        lines += get_remove_lines(fixtures[i % FIXTURES].full_grid, remove_lines);
+    }
+
+    sink = lines;
+}
+
+static void bench_grid_copy(long iters)
+{
+    for (long i = 0; i < iters; i++) {
+        memcpy(work_grid, fixtures[i % FIXTURES].full_grid, sizeof(work_grid));
+        sink = work_grid[i % GRID_SIZE_X][GRID_SIZE_Y - 1];
+    }
+}
+
+// Includes a grid copy and the line detection that finds the rows
+static void bench_line_remove(long iters)
+{
+    int lines = 0;
+    int remove_lines[4];
+
+    for (long i = 0; i < iters; i++) {
+        memcpy(work_grid, fixtures[i % FIXTURES].full_grid, sizeof(work_grid));
+        remove_lines[0] = remove_lines[1] = remove_lines[2] = remove_lines[3] = -1;
+        get_remove_lines(work_grid, remove_lines);
+        lines += do_remove_lines(work_grid, remove_lines);
+    }
+
+    sink = lines;
+}
+
+// What the game does once a piece lands: look for full rows, then spawn the
+// next piece. Includes a grid copy.
+static void bench_lock_spawn(long iters)
+{
+    int spawned = 0;
+    int remove_lines[4];
+    int tetrominoe[4][2];
+
+    for (long i = 0; i < iters; i++) {
+        struct fixture* fx = &fixtures[i % FIXTURES];
+
+        memcpy(work_grid, fx->game.grid, sizeof(work_grid));
+        place(work_grid, fx->falling, 0);
+        get_remove_lines(work_grid, remove_lines);
+        spawned += create_tetrominoe(tetrominoe, work_grid, fx->game.block_colours, fx->game.next);
+    }
+
+    sink = spawned;
+}
+
+static void bench_render(long iters)
+{
+    for (long i = 0; i < iters; i++) {
+        engine_render(&fixtures[i % FIXTURES].game, frame);
+    }
+
+    sink = frame[81];
+}
+
+// Every reachable resting place of the falling piece
+static void bench_placements(long iters)
+{
+    static struct placement_search search;
+    static struct placement placements[PLACEMENT_MAX];
+    int found = 0;
+
+    for (long i = 0; i < iters; i++) {
+        struct fixture* fx = &fixtures[i % FIXTURES];
+        found += find_placements(&search, fx->game.tetrominoe, fx->game.grid, fx->falling_type, placements, PLACEMENT_MAX);
+    }
+
+    sink = found;
+}
+
+// One board at a time, then in batches as a search would score them
+static void bench_evaluate(long iters)
+{
+    static struct board boards[FIXTURES];
+    int score = 0;
+
+    for (int i = 0; i < FIXTURES; i++) {
+        board_from_grid(&boards[i], fixtures[i].game.grid, fixtures[i].game.tetrominoe);
+    }
+
+    for (long i = 0; i < iters; i++) {
+        score += board_evaluate(&boards[i % FIXTURES], 0, &eval_default_weights);
+    }
+
+    sink = score;
+}
+
+static void bench_evaluate_many(long iters)
+{
+    static struct board boards[FIXTURES];
+    static int lines[FIXTURES];
+    static int scores[FIXTURES];
+
+    for (int i = 0; i < FIXTURES; i++) {
+        board_from_grid(&boards[i], fixtures[i].game.grid, fixtures[i].game.tetrominoe);
+    }
+
+    for (long i = 0; i < iters; i += FIXTURES) {
+        board_evaluate_many(boards, lines, FIXTURES, &eval_default_weights, scores);
+    }
+
+    sink = scores[0];
+}
+
+struct bench
+{
+    const char* name;
+    void (*run)(long iters);
+};
+
+static const struct bench benches[] = {
+    { "collision", bench_collision },
+    { "move", bench_move },
+    { "rotate", bench_rotate },
+    { "line_detect", bench_line_detect },
+    { "grid_copy", bench_grid_copy },
+    { "line_remove", bench_line_remove },
+    { "lock_spawn", bench_lock_spawn },
+    { "render", bench_render },
+    { "placements", bench_placements },
+    { "evaluate", bench_evaluate },
+    { "evaluate_many", bench_evaluate_many },
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], 0, 0) : 1;
+    static const int fills[] = { 0, 25, 50, 75 };
+
+    zobrist_init();
+
+    for (unsigned f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        for (unsigned b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+            double best_ns = 0;
+            double best_cycles = 0;
+
+            // Fresh boards for every benchmark, best of REPEATS
+            rng = seed ? seed : 1;
+            for (int i = 0; i < FIXTURES; i++) {
+                build_fixture(&fixtures[i], fills[f]);
+            }
+
+            for (int r = 0; r < REPEATS; r++) {
+                double start_ns = now_ns();
+                uint64_t start_cycles = read_cycles();
+
+                benches[b].run(iters);
+
+                double ns = now_ns() - start_ns;
+                double cycles = (double)(read_cycles() - start_cycles);
+
+                if (r == 0 || ns < best_ns) {
+                    best_ns = ns;
+                    best_cycles = cycles;
+                }
+            }
+
+            printf("bench=%s fill=%d ops=%ld ns_per_op=%.2f cycles_per_op=%.1f\n",
+                benches[b].name, fills[f], iters, best_ns / iters, best_cycles / iters);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,360 @@
+// engine_diff.c — differential test of engine.c against the reference rules
+// Build with ./build_host.sh, then: ./engine_diff [trials] [seed] [steps]
+//
+// Every trial builds a random board (fill, level, falling piece) from its
+// seed, then feeds the same random key/time stream to ref_game_step and
+// game_step and compares the full game state after every step. The
+// primitives (collision, move, rotate, line removal) are also compared
+// directly on random placements. On the first divergence the input trace
+// is shrunk to a minimal one that still diverges and printed with both
+// states; the exit status is 1. Otherwise it prints
+//   diff ok trials=... steps=... seconds=... steps_per_min=...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "engine_ref.h"
+
+#define MAX_STEPS 100000
+
+#define KEY_LEFT 1
+#define KEY_RIGHT 2
+#define KEY_UP 4
+#define KEY_DOWN 8
+#define KEY_PAUSE 16
+
+// Host HAL: both engines see the same clock
+static uint64_t host_ticks = 0;
+
+uint64_t hal_ticks(void)
+{
+    return host_ticks;
+}
+
+void hal_show_counters(struct game* game)
+{
+    (void)game;
+}
+
+void hal_show_state(struct game* game)
+{
+    (void)game;
+}
+
+// One step of input: keys held, then ticks to advance before the step
+struct step
+{
+    uint8_t keys;
+    uint8_t dt;
+};
+
+static struct game ref_game;
+static struct game opt_game;
+static struct game start_game;
+static struct step trace[MAX_STEPS];
+static struct step candidate[MAX_STEPS];
+static uint32_t rng;
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+
+    return rng;
+}
+
+#define SCALAR_FIELDS(X) \
+    X(state) X(flash_lines_count) X(lines) X(level) X(score) X(fall_delay) \
+    X(current) X(next) X(key_pressed) X(down_pressed) X(last_move) X(rng)
+
+#define ARRAY_FIELDS(X) \
+    X(grid) X(next_grid) X(tetrominoe) X(next_tetrominoe) X(remove_lines)
+
+// Name of the first field that differs, or 0. Fields are compared one by
+// one so the optimised engine may add state of its own to struct game.
+static const char* compare_games(struct game* a, struct game* b)
+{
+#define COMPARE_SCALAR(f) if (a->f != b->f) return #f;
+#define COMPARE_ARRAY(f) if (memcmp(a->f, b->f, sizeof(a->f))) return #f;
+    SCALAR_FIELDS(COMPARE_SCALAR)
+    ARRAY_FIELDS(COMPARE_ARRAY)
+#undef COMPARE_SCALAR
+#undef COMPARE_ARRAY
+
+    return 0;
+}
+
+static void print_game(const char* name, struct game* game)
+{
+    printf("%s:", name);
+#define PRINT_SCALAR(f) printf(" " #f "=%lld", (long long)game->f);
+    SCALAR_FIELDS(PRINT_SCALAR)
+#undef PRINT_SCALAR
+    printf("\n");
+
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        printf("  |");
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            int cell = game->grid[x][y];
+
+            putchar(!cell ? '.' : (cell & 0xFF) == ' ' ? '-' : '#');
+        }
+        printf("|\n");
+    }
+}
+
+// Random board: partly filled bottom rows with a hole in each, a level and
+// counters to match, and a piece at the top. Built with the reference code.
+static void build_start(uint32_t seed)
+{
+    struct game* game = &start_game;
+    int rows;
+
+    rng = seed ? seed : 1;
+    host_ticks = 0;
+
+    memset(game, 0, sizeof(*game));
+    ref_game_init(game, next_random());
+
+    rows = next_random() % (GRID_SIZE_Y - 4);
+    for (int y = GRID_SIZE_Y - rows; y < GRID_SIZE_Y; y++) {
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if (next_random() % 4) {
+                game->grid[x][y] = game->block_colours[next_random() % PIECE_TYPES];
+            }
+        }
+        game->grid[next_random() % GRID_SIZE_X][y] = 0;
+    }
+
+    game->level = next_random() % 10;
+    game->lines = game->level * 10 + next_random() % 10;
+    game->score = next_random() % 100000;
+    game->fall_delay = INITIAL_FALL_DELAY - 10 * game->level;
+
+    game->current = next_random() % PIECE_TYPES;
+    if (!ref_create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->current)) {
+        game->state = STATE_CREATE_PIECE;
+    }
+}
+
+// Keys are held for a while like a player would; time mostly advances one
+// tick per step, with the odd stall or long jump
+static void build_trace(int steps)
+{
+    uint8_t keys = 0;
+
+    for (int i = 0; i < steps; i++) {
+        uint32_t r = next_random();
+
+        if (r % 4 == 0) {
+            keys = (r >> 2) & (KEY_LEFT | KEY_RIGHT | KEY_UP | KEY_DOWN);
+            if ((r >> 8) % 200 == 0) keys |= KEY_PAUSE;
+        }
+
+        trace[i].keys = keys;
+        trace[i].dt = (r >> 16) % 16 == 0 ? (r >> 20) % 100 : (r >> 16) % 8 != 0;
+    }
+}
+
+static void apply_keys(struct game* game, uint8_t keys)
+{
+    game->left = (keys & KEY_LEFT) != 0;
+    game->right = (keys & KEY_RIGHT) != 0;
+    game->up = (keys & KEY_UP) != 0;
+    game->down = (keys & KEY_DOWN) != 0;
+    game->pause = (keys & KEY_PAUSE) != 0;
+}
+
+// Run both engines from start_game over steps. Returns the index of the
+// first step after which they differ, or -1.
+static int replay(struct step* steps, int count)
+{
+    ref_game = start_game;
+    opt_game = start_game;
+    host_ticks = 0;
+
+    for (int i = 0; i < count; i++) {
+        host_ticks += steps[i].dt;
+
+        apply_keys(&ref_game, steps[i].keys);
+        apply_keys(&opt_game, steps[i].keys);
+
+        ref_game_step(&ref_game);
+        game_step(&opt_game);
+
+        if (compare_games(&ref_game, &opt_game)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Shrink a diverging trace: drop ever smaller chunks of steps, then clear
+// keys and time on the steps that are left, keeping each change that still
+// diverges. Returns the new length.
+static int minimise(int count)
+{
+    int failed;
+
+    for (int chunk = count / 2; chunk >= 1; chunk /= 2) {
+        for (int start = 0; start + chunk <= count;) {
+            memcpy(candidate, trace, start * sizeof(struct step));
+            memcpy(candidate + start, trace + start + chunk, (count - start - chunk) * sizeof(struct step));
+
+            failed = replay(candidate, count - chunk);
+            if (failed >= 0) {
+                count = failed + 1;
+                memcpy(trace, candidate, count * sizeof(struct step));
+            } else {
+                start += chunk;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct step saved = trace[i];
+
+        trace[i].keys = 0;
+        if (replay(trace, count) < 0) trace[i].keys = saved.keys;
+
+        saved = trace[i];
+        trace[i].dt = trace[i].dt ? 1 : 0;
+        if (replay(trace, count) < 0) trace[i].dt = saved.dt;
+    }
+
+    return count;
+}
+
+static void report_divergence(uint32_t seed, int count)
+{
+    const char* field;
+
+    count = minimise(count);
+    replay(trace, count);
+    field = compare_games(&ref_game, &opt_game);
+
+    printf("diverged seed=%u steps=%d field=%s\n", seed, count, field);
+    for (int i = 0; i < count; i++) {
+        printf("  step=%d keys=%c%c%c%c%c dt=%d\n", i,
+            trace[i].keys & KEY_LEFT ? 'L' : '-', trace[i].keys & KEY_RIGHT ? 'R' : '-',
+            trace[i].keys & KEY_UP ? 'U' : '-', trace[i].keys & KEY_DOWN ? 'D' : '-',
+            trace[i].keys & KEY_PAUSE ? 'P' : '-', trace[i].dt);
+    }
+
+    print_game("ref", &ref_game);
+    print_game("opt", &opt_game);
+}
+
+// Collision probes anywhere (in or out of the grid), and every piece type
+// moved and rotated from random free spots, on the trial's start board.
+// Returns 0 and prints the case on the first mismatch.
+static int check_primitives(uint32_t seed)
+{
+    int grid_a[GRID_SIZE_X][GRID_SIZE_Y];
+    int grid_b[GRID_SIZE_X][GRID_SIZE_Y];
+    int piece_a[4][2];
+    int piece_b[4][2];
+    int lines_a[4];
+    int lines_b[4];
+
+    for (int i = 0; i < 64; i++) {
+        int type = next_random() % PIECE_TYPES;
+        int turns = next_random() % 4;
+        int direction = next_random() % 3;
+
+        ref_setup_tetrominoe(piece_a, type, (int)(next_random() % (GRID_SIZE_X + 4)) - 2);
+        for (int j = 0; j < 4; j++) {
+            piece_a[j][1] += (int)(next_random() % (GRID_SIZE_Y + 4)) - 2;
+        }
+
+        if (ref_check_tetrominoe_collision(piece_a, start_game.grid) != check_tetrominoe_collision(piece_a, start_game.grid)) {
+            printf("diverged seed=%u check_tetrominoe_collision type=%d at (%d,%d)\n", seed, type, piece_a[0][0], piece_a[0][1]);
+            return 0;
+        }
+
+        if (!ref_check_tetrominoe_collision(piece_a, start_game.grid)) continue;
+
+        memcpy(grid_a, start_game.grid, sizeof(grid_a));
+        for (int j = 0; j < 4; j++) {
+            grid_a[piece_a[j][0]][piece_a[j][1]] = start_game.block_colours[type];
+        }
+        memcpy(grid_b, grid_a, sizeof(grid_b));
+        memcpy(piece_b, piece_a, sizeof(piece_b));
+
+        for (int t = 0; t < turns; t++) {
+            ref_rotate_tetrominoe(piece_a, grid_a, type);
+            rotate_tetrominoe(piece_b, grid_b, type);
+        }
+
+        if (ref_move_tetrominoe(piece_a, grid_a, direction) != move_tetrominoe(piece_b, grid_b, direction)
+            || memcmp(piece_a, piece_b, sizeof(piece_a)) || memcmp(grid_a, grid_b, sizeof(grid_a))) {
+            printf("diverged seed=%u rotate/move type=%d turns=%d direction=%d\n", seed, type, turns, direction);
+            return 0;
+        }
+
+        // Fill the rows the piece sits in and remove them
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            grid_a[x][piece_a[0][1]] = grid_a[x][piece_a[3][1]] = start_game.block_colours[0];
+        }
+        memcpy(grid_b, grid_a, sizeof(grid_b));
+        lines_a[0] = lines_a[1] = lines_a[2] = lines_a[3] = -1;
+        memcpy(lines_b, lines_a, sizeof(lines_b));
+
+        if (ref_get_remove_lines(grid_a, lines_a) != get_remove_lines(grid_b, lines_b)
+            || ref_do_remove_lines(grid_a, lines_a) != do_remove_lines(grid_b, lines_b)
+            || memcmp(grid_a, grid_b, sizeof(grid_a)) || memcmp(lines_a, lines_b, sizeof(lines_a))) {
+            printf("diverged seed=%u get/do_remove_lines type=%d rows=%d,%d\n", seed, type, piece_a[0][1], piece_a[3][1]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    int trials = argc > 1 ? atoi(argv[1]) : 10000;
+    uint32_t seed = argc > 2 ? (uint32_t)strtoul(argv[2], 0, 0) : 1;
+    int steps = argc > 3 ? atoi(argv[3]) : 1000;
+    struct timespec start, end;
+    double seconds;
+    uint64_t total = 0;
+
+    if (steps < 1 || steps > MAX_STEPS) {
+        fprintf(stderr, "steps must be 1..%d\n", MAX_STEPS);
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int t = 0; t < trials; t++) {
+        uint32_t trial_seed = seed + t;
+        int failed;
+
+        build_start(trial_seed);
+
+        if (!check_primitives(trial_seed)) {
+            return 1;
+        }
+
+        build_trace(steps);
+        failed = replay(trace, steps);
+        total += failed < 0 ? steps : failed + 1;
+
+        if (failed >= 0) {
+            report_divergence(trial_seed, failed + 1);
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("diff ok trials=%d steps=%llu seconds=%.3f steps_per_min=%.0f\n",
+        trials, (unsigned long long)total, seconds, total / seconds * 60);
+
+    return 0;
+}
@@ -0,0 +1,577 @@
+// engine_ref.c — reference copy of the game rules
+// This is engine.c as it stood before any optimisation work, with every
+// function renamed ref_*. Do not change it: engine_diff runs it in lockstep
+// with engine.c, so it is the definition of correct behaviour. Only the
+// rendering and the headless simulation helpers are left out.
+
+#include "engine_ref.h"
+
+// Seed the piece generator. A zero seed would stick at zero, so it is bumped.
+void ref_engine_seed(struct game* game, uint32_t seed)
+{
+    game->rng = seed ? seed : 0x2545F491;
+}
+
+// xorshift32
+uint32_t ref_engine_rand(struct game* game)
+{
+    uint32_t x = game->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    game->rng = x;
+
+    return x;
+}
+
+int ref_check_tetrominoe_collision(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y])
+{
+    return tetrominoe[0][0] >= 0 && tetrominoe[0][0] < GRID_SIZE_X
+        && tetrominoe[0][1] >= 0 && tetrominoe[0][1] < GRID_SIZE_Y
+        && tetrominoe[1][0] >= 0 && tetrominoe[1][0] < GRID_SIZE_X
+        && tetrominoe[1][1] >= 0 && tetrominoe[1][1] < GRID_SIZE_Y
+        && tetrominoe[2][0] >= 0 && tetrominoe[2][0] < GRID_SIZE_X
+        && tetrominoe[2][1] >= 0 && tetrominoe[2][1] < GRID_SIZE_Y
+        && tetrominoe[3][0] >= 0 && tetrominoe[3][0] < GRID_SIZE_X
+        && tetrominoe[3][1] >= 0 && tetrominoe[3][1] < GRID_SIZE_Y
+        && !grid[tetrominoe[0][0]][tetrominoe[0][1]]
+        && !grid[tetrominoe[1][0]][tetrominoe[1][1]]
+        && !grid[tetrominoe[2][0]][tetrominoe[2][1]]
+        && !grid[tetrominoe[3][0]][tetrominoe[3][1]];
+}
+
+void ref_setup_tetrominoe(int tetrominoe[4][2], int piece, int offset_x)
+{
+    switch (piece) {
+        case PIECE_LINE:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 1;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 2;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 3;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_L:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 0;
+            break;
+
+        case PIECE_REVERSE_L:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 0;
+            tetrominoe[1][1] = 1;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 0;
+            break;
+
+        case PIECE_SQUARE:
+            tetrominoe[0][0] = offset_x + 1;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_5:
+            tetrominoe[0][0] = offset_x + 1;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 2;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 0;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 1;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_S:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 1;
+            tetrominoe[2][1] = 1;
+            tetrominoe[3][0] = offset_x + 2;
+            tetrominoe[3][1] = 1;
+            break;
+
+        case PIECE_T:
+            tetrominoe[0][0] = offset_x + 0;
+            tetrominoe[0][1] = 0;
+            tetrominoe[1][0] = offset_x + 1;
+            tetrominoe[1][1] = 0;
+            tetrominoe[2][0] = offset_x + 2;
+            tetrominoe[2][1] = 0;
+            tetrominoe[3][0] = offset_x + 1;
+            tetrominoe[3][1] = 1;
+            break;
+    }
+}
+
+int ref_create_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+{
+    ref_setup_tetrominoe(tetrominoe, piece, 4);
+
+    if (ref_check_tetrominoe_collision(tetrominoe, grid)) {
+        grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
+        grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
+        grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
+        grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void ref_create_next_tetrominoe(int tetrominoe[4][2], int grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+{
+    ref_setup_tetrominoe(tetrominoe, piece, 0);
+
+    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
+        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
+            grid[x][y] = 0;
+        }
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+}
+
+void ref_copy_tetrominoe(int src_tetrominoe[4][2], int dst_tetrominoe[4][2])
+{
+    dst_tetrominoe[0][0] = src_tetrominoe[0][0];
+    dst_tetrominoe[0][1] = src_tetrominoe[0][1];
+    dst_tetrominoe[1][0] = src_tetrominoe[1][0];
+    dst_tetrominoe[1][1] = src_tetrominoe[1][1];
+    dst_tetrominoe[2][0] = src_tetrominoe[2][0];
+    dst_tetrominoe[2][1] = src_tetrominoe[2][1];
+    dst_tetrominoe[3][0] = src_tetrominoe[3][0];
+    dst_tetrominoe[3][1] = src_tetrominoe[3][1];
+}
+
+int ref_move_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int direction)
+{
+    int moved = 0;
+    int new_tetrominoe[4][2];
+    short block_colour;
+
+    ref_copy_tetrominoe(tetrominoe, new_tetrominoe);
+
+    switch (direction) {
+        case MOVE_DOWN:
+            new_tetrominoe[0][1]++;
+            new_tetrominoe[1][1]++;
+            new_tetrominoe[2][1]++;
+            new_tetrominoe[3][1]++;
+            break;
+        case MOVE_LEFT:
+            new_tetrominoe[0][0]--;
+            new_tetrominoe[1][0]--;
+            new_tetrominoe[2][0]--;
+            new_tetrominoe[3][0]--;
+            break;
+        case MOVE_RIGHT:
+            new_tetrominoe[0][0]++;
+            new_tetrominoe[1][0]++;
+            new_tetrominoe[2][0]++;
+            new_tetrominoe[3][0]++;
+            break;
+    }
+
+    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+
+    if (ref_check_tetrominoe_collision(new_tetrominoe, grid)) {
+        ref_copy_tetrominoe(new_tetrominoe, tetrominoe);
+        moved = 1;
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
+
+    return moved;
+}
+
+void ref_rotate_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type)
+{
+    int temp_tetrominoe[4][2];
+    int new_tetrominoe[4][2];
+    int lowest_x;
+    int lowest_y;
+    int max_ext;
+
+    short block_colour;
+
+    lowest_x = tetrominoe[0][0];
+    if (lowest_x > tetrominoe[1][0]) lowest_x = tetrominoe[1][0];
+    if (lowest_x > tetrominoe[2][0]) lowest_x = tetrominoe[2][0];
+    if (lowest_x > tetrominoe[3][0]) lowest_x = tetrominoe[3][0];
+
+    lowest_y = tetrominoe[0][1];
+    if (lowest_y > tetrominoe[1][1]) lowest_y = tetrominoe[1][1];
+    if (lowest_y > tetrominoe[2][1]) lowest_y = tetrominoe[2][1];
+    if (lowest_y > tetrominoe[3][1]) lowest_y = tetrominoe[3][1];
+
+    temp_tetrominoe[0][0] = tetrominoe[0][0] - lowest_x;
+    temp_tetrominoe[1][0] = tetrominoe[1][0] - lowest_x;
+    temp_tetrominoe[2][0] = tetrominoe[2][0] - lowest_x;
+    temp_tetrominoe[3][0] = tetrominoe[3][0] - lowest_x;
+    temp_tetrominoe[0][1] = tetrominoe[0][1] - lowest_y;
+    temp_tetrominoe[1][1] = tetrominoe[1][1] - lowest_y;
+    temp_tetrominoe[2][1] = tetrominoe[2][1] - lowest_y;
+    temp_tetrominoe[3][1] = tetrominoe[3][1] - lowest_y;
+
+    switch (type) {
+        case PIECE_LINE:
+            max_ext = 4;
+            break;
+
+        case PIECE_L:
+            max_ext = 3;
+            break;
+
+        case PIECE_REVERSE_L:
+            max_ext = 3;
+            break;
+
+        case PIECE_SQUARE:
+            max_ext = 2;
+            break;
+
+        case PIECE_5:
+            max_ext = 3;
+            break;
+
+        case PIECE_S:
+            max_ext = 3;
+            break;
+
+        case PIECE_T:
+        default:
+            max_ext = 3;
+            break;
+    }
+
+    new_tetrominoe[0][0] = temp_tetrominoe[0][1];
+    new_tetrominoe[0][1] = 1-(temp_tetrominoe[0][0]-(max_ext-2));
+    new_tetrominoe[1][0] = temp_tetrominoe[1][1];
+    new_tetrominoe[1][1] = 1-(temp_tetrominoe[1][0]-(max_ext-2));
+    new_tetrominoe[2][0] = temp_tetrominoe[2][1];
+    new_tetrominoe[2][1] = 1-(temp_tetrominoe[2][0]-(max_ext-2));
+    new_tetrominoe[3][0] = temp_tetrominoe[3][1];
+    new_tetrominoe[3][1] = 1-(temp_tetrominoe[3][0]-(max_ext-2));
+
+    new_tetrominoe[0][0] = new_tetrominoe[0][0] + lowest_x;
+    new_tetrominoe[1][0] = new_tetrominoe[1][0] + lowest_x;
+    new_tetrominoe[2][0] = new_tetrominoe[2][0] + lowest_x;
+    new_tetrominoe[3][0] = new_tetrominoe[3][0] + lowest_x;
+    new_tetrominoe[0][1] = new_tetrominoe[0][1] + lowest_y;
+    new_tetrominoe[1][1] = new_tetrominoe[1][1] + lowest_y;
+    new_tetrominoe[2][1] = new_tetrominoe[2][1] + lowest_y;
+    new_tetrominoe[3][1] = new_tetrominoe[3][1] + lowest_y;
+
+    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+
+    if (ref_check_tetrominoe_collision(new_tetrominoe, grid)) {
+        ref_copy_tetrominoe(new_tetrominoe, tetrominoe);
+    }
+
+    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
+    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
+    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
+    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
+}
+
+int ref_get_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    int remove_count = 0;
+
+    for (int y = 0; y < GRID_SIZE_Y; y++) {
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if (!grid[x][y]) {
+                goto next_line;
+            }
+        }
+
+        remove_lines[remove_count++] = y;
+
+        next_line:
+        continue;
+    }
+
+    return remove_count;
+}
+
+void ref_cycle_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    for (int i = 0; i < 4; i++) {
+        if (remove_lines[i] == -1) { continue; }
+
+        // Cycle the line
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if ((grid[x][remove_lines[i]] & 0x00FF) == '#') {
+                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] & 0xFF20;
+            } else {
+                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] | '#';
+            }
+        }
+    }
+}
+
+int ref_do_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+{
+    int remove_count = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (remove_lines[i] == -1) { continue; }
+
+        remove_count++;
+
+        // Remove the line
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            grid[x][remove_lines[i]] = 0;
+        }
+
+        // Move above lines down
+        for (int y = remove_lines[i]; y != 0; y--) {
+            for (int x = 0; x < GRID_SIZE_X; x++) {
+                grid[x][y] = grid[x][y-1];
+            }
+        }
+
+        remove_lines[i] = -1;
+    }
+
+    return remove_count;
+}
+
+// Award points for lines cleared at once, and level up every ten lines
+void ref_score_lines(struct game* game, int lines_removed)
+{
+    game->lines += lines_removed;
+    if (game->lines > 9999) { game->lines = 9999; }
+
+    switch (lines_removed) {
+        case 1:
+            game->score += 40 * (game->level + 1);
+            break;
+
+        case 2:
+            game->score += 100 * (game->level + 1);
+            break;
+
+        case 3:
+            game->score += 300 * (game->level + 1);
+            break;
+
+        case 4:
+            game->score += 1200 * (game->level + 1);
+            break;
+    }
+
+    if (game->score > 99999999) { game->score = 99999999; }
+
+    if (game->level != 9 && game->lines >= (game->level * 10) + 10) {
+        game->level++;
+        game->fall_delay -= 10;
+    }
+}
+
+void ref_game_init(struct game* game, uint32_t seed)
+{
+    game->quit = 0;
+    game->restart = 0;
+    game->pause = 0;
+    game->left = 0;
+    game->right = 0;
+    game->up = 0;
+    game->down = 0;
+    game->key_pressed = 0;
+    game->down_pressed = 0;
+
+    game->state = STATE_DESCEND;
+    game->flash_lines_count = 0;
+    game->lines = 0;
+    game->level = 0;
+    game->score = 0;
+    game->fall_delay = INITIAL_FALL_DELAY;
+
+    game->next = -1;
+    game->remove_lines[0] = -1;
+    game->remove_lines[1] = -1;
+    game->remove_lines[2] = -1;
+    game->remove_lines[3] = -1;
+
+    game->last_move = hal_ticks();
+    ref_engine_seed(game, seed);
+
+    for (int i = 0; i < 10; i++) {
+        game->numbers[i] = '0' + i;
+    }
+
+    // Light gray
+    game->block_colours[0] = 0x0700;
+
+    // Red
+    game->block_colours[1] = 0x0400;
+
+    // Green
+    game->block_colours[2] = 0x0200;
+
+    // Blue
+    game->block_colours[3] = 0x0100;
+
+    // Magenta
+    game->block_colours[4] = 0x0500;
+
+    // Yellow
+    game->block_colours[5] = 0x0E00;
+
+    // Cyan
+    game->block_colours[6] = 0x0300;
+
+    // Clear the grid
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            game->grid[x][y] = 0;
+        }
+    }
+
+    // Clear the next grid
+    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
+        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
+            game->next_grid[x][y] = 0;
+        }
+    }
+}
+
+// Advance the game by one step: apply key state, then run the state machine
+void ref_game_step(struct game* game)
+{
+    uint64_t now;
+    uint64_t timediff;
+    int lines_removed;
+
+    if (game->next == -1) {
+        game->next = ref_engine_rand(game) % 7;
+        ref_create_next_tetrominoe(game->next_tetrominoe, game->next_grid, game->block_colours, game->next);
+    }
+
+    if (!game->left && !game->right && !game->up && !game->down && !game->pause) {
+        game->key_pressed = 0;
+    }
+
+    if (!game->down) {
+        game->down_pressed = 0;
+    }
+
+    if (game->state == STATE_DESCEND && !game->key_pressed && (game->left || game->right || game->up || game->down || game->pause)) {
+        if (game->left) { ref_move_tetrominoe(game->tetrominoe, game->grid, MOVE_LEFT); }
+        if (game->right) { ref_move_tetrominoe(game->tetrominoe, game->grid, MOVE_RIGHT); }
+        if (game->down) { game->down_pressed = 1; }
+        if (game->up) { ref_rotate_tetrominoe(game->tetrominoe, game->grid, game->current); }
+        if (game->pause) { game->state = STATE_PAUSED; }
+
+        game->key_pressed = 1;
+    } else if (game->state == STATE_PAUSED && !game->key_pressed && game->pause) {
+        game->state = STATE_DESCEND;
+        hal_show_state(game);
+
+        game->key_pressed = 1;
+    }
+
+    now = hal_ticks();
+    timediff = now - game->last_move;
+
+    switch (game->state) {
+        case STATE_CREATE_PIECE:
+            if (ref_create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->next)) {
+                game->current = game->next;
+                game->next = -1;
+                game->state = STATE_DESCEND;
+                game->down_pressed = 0;
+            } else {
+                game->state = STATE_GAME_OVER;
+            }
+
+            break;
+
+        case STATE_DESCEND:
+            if (timediff > (game->down_pressed ? DROP_FALL_DELAY : game->fall_delay)) {
+                if (!ref_move_tetrominoe(game->tetrominoe, game->grid, MOVE_DOWN)) {
+                    if (ref_get_remove_lines(game->grid, game->remove_lines) > 0) {
+                        game->state = STATE_ROW_FLASH;
+                    } else {
+                        game->state = STATE_CREATE_PIECE;
+                    }
+                }
+
+                game->last_move = now;
+            }
+
+            break;
+
+        case STATE_ROW_FLASH:
+            if (timediff > 10) {
+                if (game->flash_lines_count < 4) {
+                    ref_cycle_remove_lines(game->grid, game->remove_lines);
+                    game->flash_lines_count++;
+                } else {
+                    game->flash_lines_count = 0;
+                    game->state = STATE_ROW_REMOVE;
+                }
+
+                game->last_move = now;
+            }
+
+            break;
+
+        case STATE_ROW_REMOVE:
+            lines_removed = ref_do_remove_lines(game->grid, game->remove_lines);
+            ref_score_lines(game, lines_removed);
+            hal_show_counters(game);
+
+            game->state = STATE_CREATE_PIECE;
+
+            break;
+
+        case STATE_GAME_OVER:
+            hal_show_state(game);
+
+            break;
+
+        case STATE_PAUSED:
+            hal_show_state(game);
+
+            break;
+    }
+}
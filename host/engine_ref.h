@@ -0,0 +1,27 @@
+// engine_ref.h — the reference game rules in engine_ref.c
+// Same signatures as the functions in engine.h, prefixed ref_.
+
+#ifndef ENGINE_REF_H
+#define ENGINE_REF_H
+
+#include "../engine.h"
+
+void ref_engine_seed(struct game* game, uint32_t seed);
+uint32_t ref_engine_rand(struct game* game);
+
+int ref_check_tetrominoe_collision(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y]);
+void ref_setup_tetrominoe(int tetrominoe[4][2], int piece, int offset_x);
+int ref_create_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece);
+void ref_create_next_tetrominoe(int tetrominoe[4][2], int grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece);
+void ref_copy_tetrominoe(int src_tetrominoe[4][2], int dst_tetrominoe[4][2]);
+int ref_move_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int direction);
+void ref_rotate_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type);
+int ref_get_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+void ref_cycle_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+int ref_do_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4]);
+void ref_score_lines(struct game* game, int lines_removed);
+
+void ref_game_init(struct game* game, uint32_t seed);
+void ref_game_step(struct game* game);
+
+#endif
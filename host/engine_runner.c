@@ -0,0 +1,493 @@
+// engine_runner.c — native checks and a throughput run for the hosted engine
+// Build with ./build_host.sh, then: ./engine_runner [games]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../engine.h"
+#include "../bot.h"
+
+// Host HAL: time is whatever the runner says it is, nothing is displayed
+static uint64_t host_ticks = 0;
+
+uint64_t hal_ticks(void)
+{
+    return host_ticks;
+}
+
+void hal_show_counters(struct game* game)
+{
+    (void)game;
+}
+
+void hal_show_state(struct game* game)
+{
+    (void)game;
+}
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __func__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static struct game game;
+
+static void check_spawn(void)
+{
+    game_init(&game, 1);
+
+    CHECK(create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, PIECE_SQUARE));
+    CHECK(game.grid[5][0] && game.grid[6][0] && game.grid[5][1] && game.grid[6][1]);
+    CHECK(!game.grid[4][0] && !game.grid[7][0]);
+}
+
+static void check_walls(void)
+{
+    int moves = 0;
+
+    game_init(&game, 1);
+    create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, PIECE_LINE);
+
+    while (move_tetrominoe(game.tetrominoe, game.grid, MOVE_LEFT)) moves++;
+    CHECK(moves == 4);
+    CHECK(game.grid[0][1] && game.grid[3][1] && !game.grid[4][1]);
+
+    moves = 0;
+    while (move_tetrominoe(game.tetrominoe, game.grid, MOVE_DOWN)) moves++;
+    CHECK(moves == GRID_SIZE_Y - 2);
+}
+
+static void check_rotation(void)
+{
+    int cells;
+
+    game_init(&game, 1);
+    create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, PIECE_LINE);
+    move_tetrominoe(game.tetrominoe, game.grid, MOVE_DOWN);
+
+    // Rotation turns about the piece's bounding box corner, so only the
+    // orientation alternates; the cells drift
+    for (int turn = 1; turn <= 4; turn++) {
+        rotate_tetrominoe(game.tetrominoe, game.grid, PIECE_LINE);
+
+        if (turn % 2) {
+            CHECK(game.tetrominoe[0][0] == game.tetrominoe[3][0]);
+        } else {
+            CHECK(game.tetrominoe[0][1] == game.tetrominoe[3][1]);
+        }
+
+        cells = 0;
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            for (int y = 0; y < GRID_SIZE_Y; y++) {
+                cells += game.grid[x][y] != 0;
+            }
+        }
+        CHECK(cells == 4);
+    }
+}
+
+static void check_line_clear(void)
+{
+    game_init(&game, 1);
+
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        game.grid[x][GRID_SIZE_Y - 1] = 0x0700;
+    }
+    game.grid[3][GRID_SIZE_Y - 2] = 0x0400;
+
+    CHECK(get_remove_lines(game.grid, game.remove_lines) == 1);
+    CHECK(game.remove_lines[0] == GRID_SIZE_Y - 1);
+    CHECK(do_remove_lines(game.grid, game.remove_lines) == 1);
+    CHECK(game.grid[3][GRID_SIZE_Y - 1] == 0x0400);
+    CHECK(!game.grid[0][GRID_SIZE_Y - 1] && !game.grid[3][GRID_SIZE_Y - 2]);
+    CHECK(game.remove_lines[0] == -1);
+}
+
+static void check_scoring(void)
+{
+    game_init(&game, 1);
+
+    score_lines(&game, 4);
+    CHECK(game.score == 1200 && game.lines == 4 && game.level == 0);
+
+    for (int i = 0; i < 6; i++) score_lines(&game, 1);
+    CHECK(game.lines == 10 && game.level == 1);
+    CHECK(game.score == 1200 + 6 * 40);
+    CHECK(game.fall_delay == INITIAL_FALL_DELAY - 10);
+
+    score_lines(&game, 2);
+    CHECK(game.score == 1200 + 6 * 40 + 100 * 2);
+}
+
+static void check_game_over(void)
+{
+    game_init(&game, 1);
+
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        game.grid[x][1] = 0x0700;
+    }
+    game.state = STATE_CREATE_PIECE;
+
+    game_step(&game);
+    CHECK(game.state == STATE_GAME_OVER);
+}
+
+static void check_seed(void)
+{
+    struct game other;
+
+    game_init(&game, 42);
+    game_init(&other, 42);
+
+    for (int i = 0; i < 100; i++) {
+        CHECK(engine_rand(&game) == engine_rand(&other));
+    }
+
+    game_init(&game, 0);
+    CHECK(engine_rand(&game) != 0);
+}
+
+// Every placement's inputs, replayed with move/rotate_tetrominoe, must end
+// in its cells and be unable to go lower. Every plain drop (rotate, shift,
+// fall) must be among the placements.
+static void check_placements(void)
+{
+    static struct placement_search search;
+    static struct placement placements[PLACEMENT_MAX];
+    struct game trial;
+    int start[4][2];
+    int count;
+
+    for (int g = 0; g < 200; g++) {
+        game_init(&game, g + 1);
+
+        for (int y = GRID_SIZE_Y - 8; y < GRID_SIZE_Y; y++) {
+            for (int x = 0; x < GRID_SIZE_X; x++) {
+                if (engine_rand(&game) % 3) game.grid[x][y] = 0x0700;
+            }
+        }
+
+        game.current = engine_rand(&game) % PIECE_TYPES;
+        if (!create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, game.current)) continue;
+        copy_tetrominoe(game.tetrominoe, start);
+
+        count = find_placements(&search, game.tetrominoe, game.grid, game.current, placements, PLACEMENT_MAX);
+        CHECK(count > 0 && count < PLACEMENT_MAX);
+
+        for (int p = 0; p < count; p++) {
+            trial = game;
+
+            for (int i = 0; i < placements[p].inputs; i++) {
+                switch (placements[p].input[i]) {
+                    case 'L': CHECK(move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_LEFT)); break;
+                    case 'R': CHECK(move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_RIGHT)); break;
+                    case 'D': CHECK(move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_DOWN)); break;
+                    case 'U': rotate_tetrominoe(trial.tetrominoe, trial.grid, trial.current); break;
+                }
+            }
+
+            CHECK(!move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_DOWN));
+            CHECK(same_cells(trial.tetrominoe, placements[p].tetrominoe));
+        }
+
+        for (int rotations = 0; rotations < 4; rotations++) {
+            for (int shift = -5; shift <= 5; shift++) {
+                int found = 0;
+
+                trial = game;
+                for (int i = 0; i < rotations; i++) rotate_tetrominoe(trial.tetrominoe, trial.grid, trial.current);
+                for (int i = 0; i < shift && move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_RIGHT); i++);
+                for (int i = 0; i > shift && move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_LEFT); i--);
+                while (move_tetrominoe(trial.tetrominoe, trial.grid, MOVE_DOWN));
+
+                for (int p = 0; p < count && !found; p++) {
+                    found = same_cells(trial.tetrominoe, placements[p].tetrominoe);
+                }
+                CHECK(found);
+            }
+        }
+
+        CHECK(!memcmp(start, game.tetrominoe, sizeof(start)));
+    }
+
+    // A square in a serpentine corridor: two rows open, then a wall with a
+    // gap at alternate ends. The lower levels are too many inputs away, so
+    // they are counted as truncated rather than returned.
+    game_init(&game, 1);
+    for (int y = 2; y < GRID_SIZE_Y; y += 3) {
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            if (y / 3 % 2 ? x > 1 : x < GRID_SIZE_X - 2) game.grid[x][y] = 0x0700;
+        }
+    }
+    game.current = PIECE_SQUARE;
+    CHECK(create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, game.current));
+
+    count = find_placements(&search, game.tetrominoe, game.grid, game.current, placements, PLACEMENT_MAX);
+    CHECK(count > 0 && search.truncated > 0);
+    for (int p = 0; p < count; p++) {
+        CHECK(placements[p].inputs <= PLACEMENT_MAX_INPUTS);
+    }
+}
+
+// The bitmask features against a cell by cell count, and the batched
+// evaluator against the single one, on random ragged boards
+static void check_evaluator(void)
+{
+    static struct board boards[37];
+    static int lines[37];
+    static int scores[37];
+    struct eval_terms features;
+    struct eval_terms expect;
+    int heights[GRID_SIZE_X];
+    uint32_t rng = 7;
+
+    for (int b = 0; b < 37; b++) {
+        int cell[GRID_SIZE_X][GRID_SIZE_Y + 1];
+
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            boards[b].rows[y] = 0;
+            for (int x = 0; x < GRID_SIZE_X; x++) {
+                rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+                cell[x][y] = b && y > (int)(rng % GRID_SIZE_Y) && rng % 4; // Board 0 empty
+                boards[b].rows[y] |= cell[x][y] << x;
+            }
+        }
+        lines[b] = b % 5;
+
+        memset(&expect, 0, sizeof(expect));
+        expect.lines = lines[b];
+
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            cell[x][GRID_SIZE_Y] = 1;
+            heights[x] = 0;
+            for (int y = GRID_SIZE_Y - 1; y >= 0; y--) {
+                if (cell[x][y]) heights[x] = GRID_SIZE_Y - y;
+            }
+            expect.height += heights[x];
+        }
+
+        for (int x = 0; x < GRID_SIZE_X; x++) {
+            int top = GRID_SIZE_Y - heights[x];
+
+            if (x + 1 < GRID_SIZE_X) expect.bumpiness += abs(heights[x] - heights[x + 1]);
+
+            for (int y = 0; y < GRID_SIZE_Y; y++) {
+                int left = x == 0 || cell[x - 1][y];
+                int right = x == GRID_SIZE_X - 1 || cell[x + 1][y];
+
+                expect.holes += y > top && !cell[x][y];
+                expect.wells += y < top && left && right;
+                expect.col_transitions += cell[x][y] != (y ? cell[x][y - 1] : 0);
+                expect.row_transitions += (x ? cell[x - 1][y] : 1) != cell[x][y];
+                if (x == GRID_SIZE_X - 1) expect.row_transitions += !cell[x][y];
+            }
+            expect.col_transitions += !cell[x][GRID_SIZE_Y - 1];
+        }
+
+        board_features(&boards[b], lines[b], &features);
+        CHECK(!memcmp(&features, &expect, sizeof(features)));
+    }
+
+    board_evaluate_many(boards, lines, 37, &eval_default_weights, scores);
+    for (int b = 0; b < 37; b++) {
+        CHECK(scores[b] == board_evaluate(&boards[b], lines[b], &eval_default_weights));
+    }
+}
+
+// Apply one key change and let game_step see it, as input_task does
+static void set_key(void* ctx, char key, int pressed)
+{
+    (void)ctx;
+
+    switch (key) {
+        case 'L': game.left = pressed; break;
+        case 'R': game.right = pressed; break;
+        case 'U': game.up = pressed; break;
+        case 'D': game.down = pressed; break;
+    }
+
+    game_step(&game);
+}
+
+// The bot has to keep a game going through the key state alone, gravity
+// at full speed included
+static void check_bot(void)
+{
+    static struct bot bot;
+    struct bot_keys keys = { set_key, 0, 0, 0 };
+    uint64_t end = host_ticks + 100000;
+
+    game_init(&game, 2);
+    game.current = engine_rand(&game) % 7;
+    create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, game.current);
+    bot_init(&bot, 0);
+
+    while (game.pieces < 500 && game.state != STATE_GAME_OVER && host_ticks < end) {
+        host_ticks++;
+        game_step(&game);
+
+        if (game.state == STATE_DESCEND) bot_play_turn(&bot, &game, &keys, 1);
+    }
+
+    CHECK(game.pieces == 500);
+    CHECK(game.lines >= 150);
+    CHECK(bot.choices >= 500 && bot.nodes > 0);
+}
+
+#define LOOKAHEAD_THREADS 4
+
+static struct lookahead round_serial;
+static struct lookahead round_threaded;
+static struct lookahead_scratch lookahead_scratch[LOOKAHEAD_THREADS];
+static struct tt_bucket check_tt_buckets[1024];
+static struct tt check_tt;
+
+static void* lookahead_thread(void* arg)
+{
+    struct lookahead_scratch* scratch = arg;
+    int candidate;
+
+    while ((candidate = lookahead_claim(&round_threaded)) >= 0) {
+        lookahead_score(&round_threaded, candidate, scratch);
+    }
+
+    return 0;
+}
+
+static void lookahead_threads(void)
+{
+    pthread_t threads[LOOKAHEAD_THREADS];
+
+    for (int t = 0; t < LOOKAHEAD_THREADS; t++) {
+        pthread_create(&threads[t], 0, lookahead_thread, &lookahead_scratch[t]);
+    }
+    for (int t = 0; t < LOOKAHEAD_THREADS; t++) {
+        pthread_join(threads[t], 0);
+    }
+}
+
+// A round scored by several threads at once must end the same as one
+// scored in order: every candidate once, the same best and node count.
+// Hashes kept up in board_place must match ones made from scratch, and a
+// transposition table, shared by the threads and filled by earlier rounds,
+// must not change the result.
+static void check_lookahead(void)
+{
+    static struct bot bot;
+    struct lookahead start;
+    uint32_t hits = 0;
+    int candidate;
+
+    tt_init(&check_tt, check_tt_buckets, sizeof(check_tt_buckets));
+
+    for (int g = 0; g < 50; g++) {
+        sim_start(&game, g + 1);
+        for (int i = 0; i < g % 20; i++) sim_place(&game, i % 4, i % 9 - 4);
+        if (game.state == STATE_GAME_OVER) continue;
+
+        bot_init(&bot, 0);
+        CHECK(bot_lookahead_start(&bot, &game, &round_serial));
+        start = round_serial;
+        round_threaded = round_serial;
+
+        for (int c = 0; c < round_serial.count; c++) {
+            CHECK(round_serial.boards[c].hash && round_serial.boards[c].hash == board_hash(&round_serial.boards[c]));
+        }
+
+        while ((candidate = lookahead_claim(&round_serial)) >= 0) {
+            lookahead_score(&round_serial, candidate, &lookahead_scratch[0]);
+        }
+
+        lookahead_threads();
+
+        CHECK(round_serial.scored == (uint32_t)round_serial.count && round_serial.best);
+        CHECK(round_threaded.scored == round_serial.scored);
+        CHECK(round_threaded.best == round_serial.best);
+        CHECK(round_threaded.nodes == round_serial.nodes);
+
+        for (int pass = 0; pass < 2; pass++) {
+            round_threaded = start;
+            round_threaded.tt = &check_tt;
+            lookahead_threads();
+            CHECK(round_threaded.best == round_serial.best);
+        }
+
+        CHECK(bot_lookahead_finish(&bot, &game, &round_serial));
+    }
+
+    for (int t = 0; t < LOOKAHEAD_THREADS; t++) hits += lookahead_scratch[t].tt_stats.hits;
+    CHECK(hits > 0);
+}
+
+// Play games with random key presses until each one is over, one tick per
+// step. Returns the number of steps taken.
+static uint64_t play_games(int games, uint32_t seed)
+{
+    uint64_t steps = 0;
+
+    srand(seed);
+
+    for (int i = 0; i < games; i++) {
+        game_init(&game, seed + i);
+        game.current = engine_rand(&game) % 7;
+        create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, game.current);
+
+        while (game.state != STATE_GAME_OVER) {
+            int keys = rand();
+
+            game.left = keys & 1;
+            game.right = (keys >> 1) & 1;
+            game.up = (keys >> 2) & 1;
+            game.down = (keys >> 3) & 1;
+
+            host_ticks++;
+            game_step(&game);
+            steps++;
+        }
+    }
+
+    return steps;
+}
+
+int main(int argc, char** argv)
+{
+    int games = argc > 1 ? atoi(argv[1]) : 1000;
+    struct timespec start, end;
+    uint64_t steps;
+    double seconds;
+
+    zobrist_init();
+    check_spawn();
+    check_walls();
+    check_rotation();
+    check_line_clear();
+    check_scoring();
+    check_game_over();
+    check_seed();
+    check_placements();
+    check_evaluator();
+    check_bot();
+    check_lookahead();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("checks ok\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    steps = play_games(games, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("games=%d steps=%llu seconds=%.3f steps_per_sec=%.0f\n",
+        games, (unsigned long long)steps, seconds, steps / seconds);
+
+    return 0;
+}
@@ -1,5 +1,5 @@
 ; isr_stub.s -- very small IRQ0 wrapper (NASM)
-; Exports: irq0_stub
+; Exports: irq0_stub, irq1_stub, ipi_wake_stub, spurious_stub
 
 BITS 32
 GLOBAL irq0_stub
@@ -7,14 +7,39 @@ GLOBAL irq1_stub
 
 SECTION .text
 extern irq_dispatch
+extern irq_save_sse ; set in kernel.c when the C code may use SSE
+
+; The interrupted code owns the FPU/SSE registers, and C handlers built with
+; an SSE -march may clobber them, so save them around the call when needed.
+; Uses EBP as the frame pointer; pusha/popa preserve the interrupted one.
+%macro SAVE_FPU 0
+    mov  ebp, esp
+    cmp  byte [irq_save_sse], 0
+    je   %%done
+    sub  esp, 512
+    and  esp, ~15
+    fxsave [esp]
+%%done:
+%endmacro
+
+%macro RESTORE_FPU 0
+    cmp  byte [irq_save_sse], 0
+    je   %%done
+    fxrstor [esp]
+%%done:
+    mov  esp, ebp
+%endmacro
+
 ; IRQ0 entry (vector 0x20)
 ; Preserve general-purpose registers, call C dispatcher with IRQ number (0)
 irq0_stub:
     cli
     pusha
+    SAVE_FPU
     push dword 0        ; push IRQ number
     call irq_dispatch   ; C function will handle and EOI
     add  esp, 4
+    RESTORE_FPU
     popa
     sti
     iret
@@ -22,9 +47,31 @@ irq0_stub:
 irq1_stub:
     cli
     pusha
+    SAVE_FPU
     push dword 1        ; push IRQ number
     call irq_dispatch   ; C function will handle and EOI
     add  esp, 4
+    RESTORE_FPU
+    popa
+    sti
+    iret
+
+; Local APIC interrupts (vectors 0x40 and 0xFF)
+GLOBAL ipi_wake_stub
+GLOBAL spurious_stub
+extern ipi_wake_handler_c
+
+; Wake-up IPI: only has to bring a CPU out of hlt, the C side sends the EOI
+ipi_wake_stub:
+    cli
+    pusha
+    SAVE_FPU
+    call ipi_wake_handler_c
+    RESTORE_FPU
     popa
     sti
     iret
+
+; Spurious APIC interrupt: must not be acknowledged with an EOI
+spurious_stub:
+    iret
@@ -2,6 +2,9 @@
 // Compile with -ffreestanding -fno-pic -fno-pie -nostdlib -m32
 
 #include "stdint.h"
+#include "layout.h"
+#include "engine.h"
+#include "bot.h"
 
 #define PIC1_CMD 0x20
 #define PIC1_DATA 0x21
@@ -15,12 +18,49 @@
 
 #define IDT_SIZE 256
 
+// boot_magic values, see kernel_entry.asm. Anything else means loader.asm.
+#define BOOT_MAGIC_MULTIBOOT 0x2BADB002
+#define BOOT_MAGIC_PVH       0x336EC578
+
+extern uint32_t boot_magic; // defined in assembly
+extern uint32_t boot_info;  // defined in assembly, multiboot info or hvm_start_info
+
+// Section bounds from linker.ld
+extern char __text_start[];
+extern char __rodata_start[];
+extern char __data_start[];
+extern char __bss_start[];
+extern char __bss_end[];
+extern char __kernel_end[];
+
+// Left at 0x500 by lz4_stub.asm when boot.img holds a compressed kernel
+#define BOOT_LZ4_MAGIC 0x20345A4C // "LZ4 "
+
+struct boot_lz4_info
+{
+    uint32_t magic;
+    uint32_t cycles; // TSC cycles spent decompressing
+    uint32_t compressed_size;
+    uint32_t size;
+};
+
+static volatile struct boot_lz4_info* const boot_lz4 = (struct boot_lz4_info*)0x500;
+
 // Simple VGA text write at 0xB8000
 static volatile unsigned short* const VGA = (unsigned short*)0xB8000;
-static uint8_t scancode = 0;
+
+// Scancodes queued by the keyboard IRQ, consumed by read_keyb()
+#define KEYB_BUFFER_SIZE 16 // Must be a power of two
+static volatile uint8_t keyb_buffer[KEYB_BUFFER_SIZE];
+static volatile uint32_t keyb_head = 0;
+static volatile uint32_t keyb_tail = 0;
 static char keyb_char = '\0';
 static char keyb_pressed = 0;
 
+// Keys from the keyboard itself, as opposed to ones keyb_inject() queued
+static volatile uint32_t keyb_real_count = 0;
+static volatile uint8_t keyb_real_last = 0;
+
 static const char scancode_table[128] = {
     0,  27, '1','2','3','4','5','6','7','8','9','0','-','=', '\b',
     '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n', 0,
@@ -29,11 +69,21 @@ static const char scancode_table[128] = {
 };
 
 
-void read_keyb()
+// Consume one queued scancode. Returns 0 if none was waiting.
+int read_keyb()
 {
+    uint8_t scancode;
+
     keyb_char = '\0';
     keyb_pressed = 0;
 
+    if (keyb_tail == __atomic_load_n(&keyb_head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    scancode = keyb_buffer[keyb_tail & (KEYB_BUFFER_SIZE - 1)];
+    __atomic_store_n(&keyb_tail, keyb_tail + 1, __ATOMIC_RELEASE);
+
     if (scancode & 0x80) {
         keyb_pressed = 0;
         scancode = scancode & 0x7F;
@@ -45,7 +95,7 @@ void read_keyb()
         keyb_char = scancode_table[scancode];
     }
 
-    scancode = 0;
+    return 1;
 }
 
 static inline void outb(uint16_t port, uint8_t val)
@@ -59,16 +109,71 @@ static inline uint8_t inb(uint16_t port)
     return ret;
 }
 
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d)
+{
+    __asm__ __volatile__ ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val)
+{
+    __asm__ __volatile__ ("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+// The "memory" clobbers keep the optimiser from moving loads and stores of
+// state shared with IRQ handlers out of the cli/sti window
 static inline void disable_interrupts()
 {
-    __asm__ __volatile__ ("cli");
+    __asm__ __volatile__ ("cli" : : : "memory");
 }
 
 static inline void enable_interrupts()
 {
-    __asm__ __volatile__ ("sti");
+    __asm__ __volatile__ ("sti" : : : "memory");
+}
+
+// gcc may emit calls to these even when freestanding (struct copies, loops
+// it recognises at -O2), so the kernel brings its own. The string
+// instructions keep them from being turned back into calls to themselves.
+__attribute__((used)) void* memcpy(void* dst, const void* src, __SIZE_TYPE__ n)
+{
+    void* ret = dst;
+
+    __asm__ __volatile__ ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+
+    return ret;
+}
+
+__attribute__((used)) void* memset(void* dst, int c, __SIZE_TYPE__ n)
+{
+    void* ret = dst;
+
+    __asm__ __volatile__ ("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+
+    return ret;
 }
 
+// Read by isr_stub.asm: save the SSE state around C handlers if the
+// compiler was allowed to use it
+#ifdef __SSE__
+uint8_t irq_save_sse = 1;
+#else
+uint8_t irq_save_sse = 0;
+#endif
+
 // Remap PIC: master to 0x20-0x27, slave to 0x28-0x2F
 void pic_remap()
 {
@@ -91,560 +196,2108 @@ void pic_remap()
     outb(PIC2_DATA, a2);
 }
 
-static inline void pic_send_eoi(uint8_t irq)
+// Serial port (COM1) for logs and counters, mirrored to the QEMU debugcon
+#define COM1 0x3F8
+#define DEBUGCON_PORT 0xE9
+
+void serial_init()
 {
-    if (irq >= 8) outb(PIC2_CMD, 0x20); // send to slave
-    outb(PIC1_CMD, 0x20);               // send to master
+    outb(COM1 + 1, 0x00); // No interrupts
+    outb(COM1 + 3, 0x80); // DLAB on
+    outb(COM1 + 0, 0x01); // Divisor 1: 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03); // 8N1, DLAB off
+    outb(COM1 + 2, 0xC7); // FIFO on, cleared, 14 byte threshold
+    outb(COM1 + 4, 0x03); // DTR, RTS
 }
 
-static volatile uint64_t ticks_count = 0;
-
-// Mode 2 (rate generator), read/write latch low then high (lo/hi)
-void pit_set_frequency(uint32_t hz)
+void serial_putc(char c)
 {
-    if (hz == 0) return;
-    uint32_t divisor = PIT_BASE_HZ / hz;
-    if (divisor == 0) divisor = 1;
-    uint8_t lo = divisor & 0xFF;
-    uint8_t hi = (divisor >> 8) & 0xFF;
+    while (!(inb(COM1 + 5) & 0x20)) {
+        __asm__ __volatile__ ("pause");
+    }
 
-    // Command: channel 0, access lobyte/hibyte, mode 2, binary
-    outb(PIT_CMD, 0x34);
-    outb(PIT_CHANNEL0, lo);
-    outb(PIT_CHANNEL0, hi);
+    outb(COM1, c);
+    outb(DEBUGCON_PORT, c);
 }
 
-// C handler called from IRQ wrapper
-void pit_tick_handler_c(void)
+void serial_puts(const char* str)
 {
-    ticks_count++;
-    // [optional] do scheduling, timeouts, etc.
-
-    // send EOI (PIC)
-    // extern void pic_send_eoi(uint8_t irq);
-    pic_send_eoi(0);
+    while (*str) {
+        if (*str == '\n') serial_putc('\r');
+        serial_putc(*str++);
+    }
 }
 
-void keyb_handler_c()
+// Divide *n by d in place and return the remainder. Uses two 32-bit divl
+// so no 64-bit division helper from libgcc is needed.
+static inline uint32_t div64_32(uint64_t* n, uint32_t d)
 {
-    scancode = inb(0x60);
-    pic_send_eoi(1);
-}
+    uint32_t hi = (uint32_t)(*n >> 32);
+    uint32_t lo = (uint32_t)*n;
+    uint32_t q_hi = hi / d;
+    uint32_t rem;
 
-typedef void (*irq_handler_t)(void);
-static irq_handler_t irq_handlers[16];
+    hi %= d;
+    __asm__ ("divl %4" : "=a"(lo), "=d"(rem) : "a"(lo), "d"(hi), "rm"(d));
+    *n = ((uint64_t)q_hi << 32) | lo;
 
-void register_irq_handler(int irq, void (*handler)(void))
-{
-    if (irq < 0 || irq > 15) return;
-    irq_handlers[irq] = handler;
+    return rem;
 }
 
-// Initialize PIT and register handler
-void pit_init(uint32_t hz)
+static void serial_put_u64(uint64_t value)
 {
-    disable_interrupts();
-    pic_remap();              // remap PIC if not already done
-    pit_set_frequency(hz);
-    register_irq_handler(0, pit_tick_handler_c); // IRQ0 -> handler
-    enable_interrupts();
-}
+    char buf[21];
+    int i = 20;
 
-void keyb_init()
-{
-    disable_interrupts();
-    register_irq_handler(1, keyb_handler_c);
-    enable_interrupts();
-}
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + div64_32(&value, 10);
+    } while (value);
 
-struct idt_entry
-{
-    uint16_t offset_low;
-    uint16_t sel;
-    uint8_t  zero;
-    uint8_t  flags;
-    uint16_t offset_high;
-} __attribute__((packed));
+    serial_puts(&buf[i]);
+}
 
-struct idtr
+// Minimal printf for the serial port: %s %c %d %u %x %llu %%
+void serial_printf(const char* fmt, ...)
 {
-    uint16_t limit;
-    uint32_t base;
-} __attribute__((packed));
-
-static struct idt_entry idt[IDT_SIZE];
-static struct idtr idtr;
+    __builtin_va_list args;
+    const char* hex = "0123456789abcdef";
+    int64_t sval;
+    uint32_t uval;
+
+    __builtin_va_start(args, fmt);
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            if (*fmt == '\n') serial_putc('\r');
+            serial_putc(*fmt);
+            continue;
+        }
 
-extern void irq0_stub(void); // defined in assembly
-extern void irq1_stub(void); // defined in assembly
+        switch (*++fmt) {
+            case 's':
+                serial_puts(__builtin_va_arg(args, const char*));
+                break;
+            case 'c':
+                serial_putc((char)__builtin_va_arg(args, int));
+                break;
+            case 'd':
+                sval = __builtin_va_arg(args, int);
+                if (sval < 0) {
+                    serial_putc('-');
+                    sval = -sval;
+                }
+                serial_put_u64((uint64_t)sval);
+                break;
+            case 'u':
+                serial_put_u64(__builtin_va_arg(args, uint32_t));
+                break;
+            case 'x':
+                uval = __builtin_va_arg(args, uint32_t);
+                for (int shift = 28; shift >= 0; shift -= 4) {
+                    serial_putc(hex[(uval >> shift) & 0xF]);
+                }
+                break;
+            case 'l':
+                if (fmt[1] == 'l' && fmt[2] == 'u') {
+                    fmt += 2;
+                    serial_put_u64(__builtin_va_arg(args, uint64_t));
+                }
+                break;
+            case '%':
+                serial_putc('%');
+                break;
+            case '\0':
+                fmt--;
+                break;
+        }
+    }
 
-static void set_idt_entry(int vector, void (*isr)(), uint16_t sel, uint8_t flags)
-{
-    uint32_t addr = (uint32_t)isr;
-    idt[vector].offset_low = addr & 0xFFFF;
-    idt[vector].sel = sel;
-    idt[vector].zero = 0;
-    idt[vector].flags = flags; // Interrupt 0x8E, Trap 0x8F, Task 0x85
-    idt[vector].offset_high = (addr >> 16) & 0xFFFF;
+    __builtin_va_end(args);
 }
 
-void idt_init()
+// Percentage part/total without 64-bit division
+static uint32_t percent64(uint64_t part, uint64_t total)
 {
-    for (int i = 0; i < IDT_SIZE; ++i) {
-        set_idt_entry(i, 0, 0x08, 0x8E); // default entries (null handler)
+    while (total >= (1u << 24)) {
+        part >>= 1;
+        total >>= 1;
     }
-    // install IRQ0 at vector 0x20
-    set_idt_entry(0x20, irq0_stub, 0x08, 0x8E);
-    set_idt_entry(0x21, irq1_stub, 0x08, 0x8E);
 
-    idtr.limit = sizeof(idt) - 1;
-    idtr.base = (uint32_t)&idt;
-    __asm__ __volatile__("lidtl (%0)" : : "r" (&idtr));
+    return total ? (uint32_t)part * 100 / (uint32_t)total : 0;
 }
 
-// Called from assembly ISR wrapper
-void irq_dispatch(int irq)
-{
-    if (irq_handlers[irq]) irq_handlers[irq]();
-}
+// Local APIC (memory mapped, base set up by smp_init)
+#define LAPIC_ID        0x020
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
 
-static short curr_frame[2000];
-static short next_frame[2000];
+#define ICR_INIT        0x00000500
+#define ICR_STARTUP     0x00000600
+#define ICR_DELIVS      0x00001000 // Delivery status (send pending)
+#define ICR_ASSERT      0x00004000
+#define ICR_ALL_BUT_SELF 0x000C0000
 
+#define IPI_WAKE_VECTOR 0x40
+#define SPURIOUS_VECTOR 0xFF
 
-void clear_screen()
+static volatile uint32_t* lapic = 0;
+
+static inline uint32_t lapic_read(uint32_t reg)
 {
-    // Clear screen (80x25)
-    for (int y = 0; y < 25; ++y) {
-        for (int x = 0; x < 80; ++x) {
-            VGA[y*80 + x] = 0x0700 | ' ';
-        }
-    }
+    return lapic[reg / 4];
 }
 
-void print_string(char* str, uint16_t colour, int row, int col)
+static inline void lapic_write(uint32_t reg, uint32_t val)
 {
-    int i = 0;
+    lapic[reg / 4] = val;
+    (void)lapic[LAPIC_ID / 4]; // Read back to wait for the write to land
+}
 
-    while (str[i]) {
-        VGA[row*80 + col + i] = colour | (unsigned char)str[i];
-        i++;
-    }
+static inline void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
 }
 
-void print_char(char *chr, uint16_t colour, int row, int col)
+static inline uint8_t lapic_id()
 {
-    VGA[row*80 + col] = colour | (unsigned char)*chr;
+    return lapic_read(LAPIC_ID) >> 24;
 }
 
-void init_frame_store()
+// Software-enable the local APIC and set the spurious vector
+static void lapic_enable()
 {
-    for (int i = 0; i < 2000; ++i) {
-        curr_frame[i] = 0x0700;
-        next_frame[i] = 0x0700;
-    }
+    lapic_write(LAPIC_SVR, 0x100 | SPURIOUS_VECTOR);
 }
 
-void draw_next_frame()
+static void lapic_send_ipi(uint8_t dest, uint32_t icr)
 {
-    for (int i = 0; i < 2000; ++i) {
-        if (curr_frame[i] != next_frame[i]) {
-            curr_frame[i] = next_frame[i];
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)dest << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
 
-            VGA[i] = curr_frame[i];
-        }
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVS) {
+        __asm__ __volatile__ ("pause");
     }
 }
 
-static inline uint8_t get_rtc_register(int reg)
+static int ioapic_active = 0; // IRQs come through the I/O APIC, see ioapic_init
+
+static inline void pic_send_eoi(uint8_t irq)
 {
-    outb(0x70, reg);
-    return inb(0x71);
+    if (irq >= 8) outb(PIC2_CMD, 0x20); // send to slave
+    outb(PIC1_CMD, 0x20);               // send to master
 }
 
-// TODO
-int rand()
+// Acknowledge a device IRQ at whichever controller delivered it
+static inline void irq_send_eoi(uint8_t irq)
 {
-    uint8_t rtc_seconds = get_rtc_register(0x00);
-
-    return ticks_count+rtc_seconds;
+    if (ioapic_active) {
+        lapic_eoi();
+    } else {
+        pic_send_eoi(irq);
+    }
 }
 
-#define GRID_SIZE_X 10
-#define GRID_SIZE_Y 20
-#define NEXT_GRID_SIZE_X 4
-#define NEXT_GRID_SIZE_Y 4
-
-#define PIECE_TYPES 7
-
-#define PIECE_LINE 0
-#define PIECE_L 1
-#define PIECE_REVERSE_L 2
-#define PIECE_SQUARE 3
-#define PIECE_5 4
-#define PIECE_S 5
-#define PIECE_T 6
+static volatile uint64_t ticks_count = 0;
+static uint32_t pit_hz = 0;
+
+// The game's clock (hal_ticks). It runs game_speed times as fast as
+// ticks_count, so attract mode can fast-forward gravity and line flashes.
+static volatile uint64_t game_ticks = 0;
+static volatile uint32_t game_speed = 1;
+
+// Stack painting
+// Stacks are filled with STACK_PAINT before use. The deepest word that no
+// longer holds it gives the high-water mark, and the bottom
+// STACK_CANARY_WORDS words act as a canary: once they are overwritten the
+// stack has overflowed into whatever lies below it.
+#define STACK_PAINT 0x57AC57AC
+#define STACK_CANARY_WORDS 4
+
+static void stack_paint(uint8_t* bottom, uint8_t* top)
+{
+    for (uint32_t* word = (uint32_t*)bottom; word < (uint32_t*)top; word++) {
+        *word = STACK_PAINT;
+    }
+}
 
-#define MOVE_DOWN 0
-#define MOVE_LEFT 1
-#define MOVE_RIGHT 2
+// Bytes of the stack that have ever been used
+static uint32_t stack_high_water(uint8_t* bottom, uint32_t size)
+{
+    uint32_t* word = (uint32_t*)bottom;
+    uint32_t* top = (uint32_t*)(bottom + size);
 
-#define STATE_CREATE_PIECE 0
-#define STATE_DESCEND 1
-#define STATE_ROW_FLASH 2
-#define STATE_ROW_REMOVE 3
-#define STATE_GAME_OVER 4
-#define STATE_PAUSED 5
+    while (word < top && *word == STACK_PAINT) word++;
 
-#define INITIAL_FALL_DELAY 90
-#define DROP_FALL_DELAY 0
+    return (uint8_t*)top - (uint8_t*)word;
+}
 
-int check_tetrominoe_collision(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y])
+static int stack_intact(uint8_t* bottom)
 {
-    return tetrominoe[0][0] >= 0 && tetrominoe[0][0] < GRID_SIZE_X
-        && tetrominoe[0][1] >= 0 && tetrominoe[0][1] < GRID_SIZE_Y
-        && tetrominoe[1][0] >= 0 && tetrominoe[1][0] < GRID_SIZE_X
-        && tetrominoe[1][1] >= 0 && tetrominoe[1][1] < GRID_SIZE_Y
-        && tetrominoe[2][0] >= 0 && tetrominoe[2][0] < GRID_SIZE_X
-        && tetrominoe[2][1] >= 0 && tetrominoe[2][1] < GRID_SIZE_Y
-        && tetrominoe[3][0] >= 0 && tetrominoe[3][0] < GRID_SIZE_X
-        && tetrominoe[3][1] >= 0 && tetrominoe[3][1] < GRID_SIZE_Y
-        && !grid[tetrominoe[0][0]][tetrominoe[0][1]]
-        && !grid[tetrominoe[1][0]][tetrominoe[1][1]]
-        && !grid[tetrominoe[2][0]][tetrominoe[2][1]]
-        && !grid[tetrominoe[3][0]][tetrominoe[3][1]];
+    for (int i = 0; i < STACK_CANARY_WORDS; i++) {
+        if (((uint32_t*)bottom)[i] != STACK_PAINT) return 0;
+    }
+
+    return 1;
 }
 
-void setup_tetrominoe(int tetrominoe[4][2], int piece, int offset_x)
+// Cooperative scheduler
+// Tasks run on their own stacks and give up the CPU with task_yield(),
+// task_wait() or task_sleep_until(). The scheduler loop runs on the boot
+// stack, always resumes the highest priority runnable task (round robin
+// between equal priorities) and halts only when every task is blocked.
+#define MAX_TASKS 8
+#define TASK_STACK_SIZE 8192
+
+#define TASK_UNUSED 0
+#define TASK_READY 1
+#define TASK_WAITING 2
+#define TASK_SLEEPING 3
+#define TASK_DEAD 4
+
+// Events tasks can wait on
+#define EVENT_TICK     0x01 // PIT tick
+#define EVENT_KEYB     0x02 // Scancode queued
+#define EVENT_INPUT    0x04 // Input task updated the key state
+#define EVENT_RENDER   0x08 // Game state changed, frame needs drawing
+#define EVENT_DEFERRED 0x10 // Deferred work queued
+
+struct task
 {
-    switch (piece) {
-        case PIECE_LINE:
-            tetrominoe[0][0] = offset_x + 0;
-            tetrominoe[0][1] = 1;
-            tetrominoe[1][0] = offset_x + 1;
-            tetrominoe[1][1] = 1;
-            tetrominoe[2][0] = offset_x + 2;
-            tetrominoe[2][1] = 1;
-            tetrominoe[3][0] = offset_x + 3;
-            tetrominoe[3][1] = 1;
-            break;
+    uint32_t esp;
+    int state;
+    int priority; // Higher runs first
+    uint32_t wait_mask;
+    volatile uint32_t pending;
+    uint64_t wake_tick;
+    void (*entry)(void);
+    const char* name;
+};
 
-        case PIECE_L:
-            tetrominoe[0][0] = offset_x + 0;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 2;
-            tetrominoe[1][1] = 1;
-            tetrominoe[2][0] = offset_x + 1;
-            tetrominoe[2][1] = 0;
-            tetrominoe[3][0] = offset_x + 2;
-            tetrominoe[3][1] = 0;
-            break;
+static struct task tasks[MAX_TASKS];
+static uint8_t task_stacks[MAX_TASKS][TASK_STACK_SIZE] __attribute__((aligned(16)));
+static struct task* current_task = 0;
+static uint32_t sched_esp;
+static int sched_last = 0;
+static volatile int sched_running = 0;
 
-        case PIECE_REVERSE_L:
-            tetrominoe[0][0] = offset_x + 0;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 0;
-            tetrominoe[1][1] = 1;
-            tetrominoe[2][0] = offset_x + 1;
-            tetrominoe[2][1] = 0;
-            tetrominoe[3][0] = offset_x + 2;
-            tetrominoe[3][1] = 0;
-            break;
+// Idle accounting: TSC cycles the BSP spends halted versus running, split by
+// the game state that was current at the time (see game_step)
+#define ACCT_STATES 8
 
-        case PIECE_SQUARE:
-            tetrominoe[0][0] = offset_x + 1;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 2;
-            tetrominoe[1][1] = 0;
-            tetrominoe[2][0] = offset_x + 1;
-            tetrominoe[2][1] = 1;
-            tetrominoe[3][0] = offset_x + 2;
-            tetrominoe[3][1] = 1;
-            break;
+struct idle_acct
+{
+    uint64_t busy_cycles;
+    uint64_t idle_cycles;
+    uint32_t halts;
+};
 
-        case PIECE_5:
-            tetrominoe[0][0] = offset_x + 1;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 2;
-            tetrominoe[1][1] = 0;
-            tetrominoe[2][0] = offset_x + 0;
-            tetrominoe[2][1] = 1;
-            tetrominoe[3][0] = offset_x + 1;
-            tetrominoe[3][1] = 1;
-            break;
+static struct idle_acct idle_acct[ACCT_STATES];
+static volatile int idle_acct_state = 0;
+static uint64_t idle_acct_mark = 0; // TSC when the BSP last woke up
 
-        case PIECE_S:
-            tetrominoe[0][0] = offset_x + 0;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 1;
-            tetrominoe[1][1] = 0;
-            tetrominoe[2][0] = offset_x + 1;
-            tetrominoe[2][1] = 1;
-            tetrominoe[3][0] = offset_x + 2;
-            tetrominoe[3][1] = 1;
-            break;
+extern void switch_context(uint32_t* save_esp, uint32_t load_esp); // defined in assembly
 
-        case PIECE_T:
-            tetrominoe[0][0] = offset_x + 0;
-            tetrominoe[0][1] = 0;
-            tetrominoe[1][0] = offset_x + 1;
-            tetrominoe[1][1] = 0;
-            tetrominoe[2][0] = offset_x + 2;
-            tetrominoe[2][1] = 0;
-            tetrominoe[3][0] = offset_x + 1;
-            tetrominoe[3][1] = 1;
-            break;
+// Latch events for every task. Safe from IRQ context.
+void task_signal_all(uint32_t events)
+{
+    for (int i = 0; i < MAX_TASKS; i++) {
+        if (tasks[i].state != TASK_UNUSED) {
+            __atomic_fetch_or(&tasks[i].pending, events, __ATOMIC_RELEASE);
+        }
     }
 }
 
-int create_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+static void task_start()
 {
-    setup_tetrominoe(tetrominoe, piece, 4);
+    current_task->entry();
 
-    if (check_tetrominoe_collision(tetrominoe, grid)) {
-        grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
-        grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
-        grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
-        grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+    current_task->state = TASK_DEAD;
+    switch_context(&current_task->esp, sched_esp);
+}
 
-        return 1;
+struct task* task_create(void (*entry)(void), int priority, const char* name)
+{
+    for (int i = 0; i < MAX_TASKS; i++) {
+        if (tasks[i].state == TASK_UNUSED || tasks[i].state == TASK_DEAD) {
+            // Initial frame popped by switch_context: edi, esi, ebx, ebp,
+            // return into task_start, then task_start's own return slot
+            uint32_t* sp = (uint32_t*)(task_stacks[i] + TASK_STACK_SIZE);
+
+            stack_paint(task_stacks[i], task_stacks[i] + TASK_STACK_SIZE);
+
+            *--sp = 0;
+            *--sp = (uint32_t)task_start;
+            *--sp = 0;
+            *--sp = 0;
+            *--sp = 0;
+            *--sp = 0;
+
+            tasks[i].esp = (uint32_t)sp;
+            tasks[i].priority = priority;
+            tasks[i].wait_mask = 0;
+            tasks[i].pending = 0;
+            tasks[i].wake_tick = 0;
+            tasks[i].entry = entry;
+            tasks[i].name = name;
+            tasks[i].state = TASK_READY;
+
+            return &tasks[i];
+        }
     }
 
     return 0;
 }
 
-void create_next_tetrominoe(int tetrominoe[4][2], int grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y], short block_colours[PIECE_TYPES], int piece)
+// Forget all tasks, e.g. before setting up a new game
+void sched_reset()
 {
-    setup_tetrominoe(tetrominoe, piece, 0);
-
-    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
-        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
-            grid[x][y] = 0;
-        }
+    for (int i = 0; i < MAX_TASKS; i++) {
+        tasks[i].state = TASK_UNUSED;
     }
 
-    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colours[piece];
-    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colours[piece];
-    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colours[piece];
-    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colours[piece];
+    sched_last = 0;
 }
 
-void copy_tetrominoe(int src_tetrominoe[4][2], int dst_tetrominoe[4][2])
+static inline void task_switch_out()
 {
-    dst_tetrominoe[0][0] = src_tetrominoe[0][0];
-    dst_tetrominoe[0][1] = src_tetrominoe[0][1];
-    dst_tetrominoe[1][0] = src_tetrominoe[1][0];
-    dst_tetrominoe[1][1] = src_tetrominoe[1][1];
-    dst_tetrominoe[2][0] = src_tetrominoe[2][0];
-    dst_tetrominoe[2][1] = src_tetrominoe[2][1];
-    dst_tetrominoe[3][0] = src_tetrominoe[3][0];
-    dst_tetrominoe[3][1] = src_tetrominoe[3][1];
+    switch_context(&current_task->esp, sched_esp);
 }
 
-int move_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int direction)
+void task_yield()
 {
-    int moved = 0;
-    int new_tetrominoe[4][2];
-    short block_colour;
-
-    copy_tetrominoe(tetrominoe, new_tetrominoe);
-
-    switch (direction) {
-        case MOVE_DOWN:
-            new_tetrominoe[0][1]++;
-            new_tetrominoe[1][1]++;
-            new_tetrominoe[2][1]++;
-            new_tetrominoe[3][1]++;
-            break;
-        case MOVE_LEFT:
-            new_tetrominoe[0][0]--;
-            new_tetrominoe[1][0]--;
-            new_tetrominoe[2][0]--;
-            new_tetrominoe[3][0]--;
-            break;
-        case MOVE_RIGHT:
-            new_tetrominoe[0][0]++;
-            new_tetrominoe[1][0]++;
-            new_tetrominoe[2][0]++;
-            new_tetrominoe[3][0]++;
-            break;
-    }
+    task_switch_out();
+}
 
-    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+// Block until one of the events in mask is signalled. Returns (and clears)
+// the events that woke the task.
+uint32_t task_wait(uint32_t mask)
+{
+    uint32_t events;
 
-    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
-    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
-    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
-    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+    for (;;) {
+        events = __atomic_fetch_and(&current_task->pending, ~mask, __ATOMIC_ACQUIRE) & mask;
+        if (events) {
+            return events;
+        }
 
-    if (check_tetrominoe_collision(new_tetrominoe, grid)) {
-        copy_tetrominoe(new_tetrominoe, tetrominoe);
-        moved = 1;
+        current_task->wait_mask = mask;
+        current_task->state = TASK_WAITING;
+        task_switch_out();
     }
-
-    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
-    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
-    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
-    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
-
-    return moved;
 }
 
-void rotate_tetrominoe(int tetrominoe[4][2], int grid[GRID_SIZE_X][GRID_SIZE_Y], int type)
+void task_sleep_until(uint64_t tick)
 {
-    int temp_tetrominoe[4][2];
-    int new_tetrominoe[4][2];
-    int lowest_x;
-    int lowest_y;
-    int max_ext;
-
-    short block_colour;
-
-    lowest_x = tetrominoe[0][0];
-    if (lowest_x > tetrominoe[1][0]) lowest_x = tetrominoe[1][0];
-    if (lowest_x > tetrominoe[2][0]) lowest_x = tetrominoe[2][0];
-    if (lowest_x > tetrominoe[3][0]) lowest_x = tetrominoe[3][0];
-
-    lowest_y = tetrominoe[0][1];
-    if (lowest_y > tetrominoe[1][1]) lowest_y = tetrominoe[1][1];
-    if (lowest_y > tetrominoe[2][1]) lowest_y = tetrominoe[2][1];
-    if (lowest_y > tetrominoe[3][1]) lowest_y = tetrominoe[3][1];
-
-    temp_tetrominoe[0][0] = tetrominoe[0][0] - lowest_x;
-    temp_tetrominoe[1][0] = tetrominoe[1][0] - lowest_x;
-    temp_tetrominoe[2][0] = tetrominoe[2][0] - lowest_x;
-    temp_tetrominoe[3][0] = tetrominoe[3][0] - lowest_x;
-    temp_tetrominoe[0][1] = tetrominoe[0][1] - lowest_y;
-    temp_tetrominoe[1][1] = tetrominoe[1][1] - lowest_y;
-    temp_tetrominoe[2][1] = tetrominoe[2][1] - lowest_y;
-    temp_tetrominoe[3][1] = tetrominoe[3][1] - lowest_y;
+    if (ticks_count >= tick) {
+        return;
+    }
 
-    switch (type) {
-        case PIECE_LINE:
-            max_ext = 4;
-            break;
+    current_task->wake_tick = tick;
+    current_task->state = TASK_SLEEPING;
+    task_switch_out();
+}
 
-        case PIECE_L:
-            max_ext = 3;
-            break;
+// Make sched_run() return once the calling task next gives up the CPU
+void sched_stop()
+{
+    sched_running = 0;
+}
 
-        case PIECE_REVERSE_L:
-            max_ext = 3;
-            break;
+static int task_runnable(struct task* t)
+{
+    switch (t->state) {
+        case TASK_READY:
+            return 1;
+        case TASK_WAITING:
+            return (t->pending & t->wait_mask) != 0;
+        case TASK_SLEEPING:
+            return ticks_count >= t->wake_tick;
+    }
 
-        case PIECE_SQUARE:
-            max_ext = 2;
-            break;
+    return 0;
+}
 
-        case PIECE_5:
-            max_ext = 3;
-            break;
+static struct task* sched_pick()
+{
+    struct task* best = 0;
+    int i;
 
-        case PIECE_S:
-            max_ext = 3;
-            break;
+    for (int n = 1; n <= MAX_TASKS; n++) {
+        i = (sched_last + n) % MAX_TASKS;
 
-        case PIECE_T:
-            max_ext = 3;
-            break;
+        if (task_runnable(&tasks[i]) && (!best || tasks[i].priority > best->priority)) {
+            best = &tasks[i];
+        }
     }
 
-    new_tetrominoe[0][0] = temp_tetrominoe[0][1];
-    new_tetrominoe[0][1] = 1-(temp_tetrominoe[0][0]-(max_ext-2));
-    new_tetrominoe[1][0] = temp_tetrominoe[1][1];
-    new_tetrominoe[1][1] = 1-(temp_tetrominoe[1][0]-(max_ext-2));
-    new_tetrominoe[2][0] = temp_tetrominoe[2][1];
-    new_tetrominoe[2][1] = 1-(temp_tetrominoe[2][0]-(max_ext-2));
-    new_tetrominoe[3][0] = temp_tetrominoe[3][1];
-    new_tetrominoe[3][1] = 1-(temp_tetrominoe[3][0]-(max_ext-2));
-
-    new_tetrominoe[0][0] = new_tetrominoe[0][0] + lowest_x;
-    new_tetrominoe[1][0] = new_tetrominoe[1][0] + lowest_x;
-    new_tetrominoe[2][0] = new_tetrominoe[2][0] + lowest_x;
-    new_tetrominoe[3][0] = new_tetrominoe[3][0] + lowest_x;
-    new_tetrominoe[0][1] = new_tetrominoe[0][1] + lowest_y;
-    new_tetrominoe[1][1] = new_tetrominoe[1][1] + lowest_y;
-    new_tetrominoe[2][1] = new_tetrominoe[2][1] + lowest_y;
-    new_tetrominoe[3][1] = new_tetrominoe[3][1] + lowest_y;
+    return best;
+}
 
-    block_colour = grid[tetrominoe[0][0]][tetrominoe[0][1]];
+// Halt until the next interrupt, charging the time since the last wake-up
+// as busy and the halt as idle. Call with interrupts disabled.
+static void idle_halt()
+{
+    struct idle_acct* acct = &idle_acct[idle_acct_state];
+    uint64_t start = rdtsc();
 
-    grid[tetrominoe[0][0]][tetrominoe[0][1]] = 0;
-    grid[tetrominoe[1][0]][tetrominoe[1][1]] = 0;
-    grid[tetrominoe[2][0]][tetrominoe[2][1]] = 0;
-    grid[tetrominoe[3][0]][tetrominoe[3][1]] = 0;
+    if (idle_acct_mark) acct->busy_cycles += start - idle_acct_mark;
 
-    if (check_tetrominoe_collision(new_tetrominoe, grid)) {
-        copy_tetrominoe(new_tetrominoe, tetrominoe);
-    }
+    __asm__ __volatile__("sti; hlt" : : : "memory");
 
-    grid[tetrominoe[0][0]][tetrominoe[0][1]] = block_colour;
-    grid[tetrominoe[1][0]][tetrominoe[1][1]] = block_colour;
-    grid[tetrominoe[2][0]][tetrominoe[2][1]] = block_colour;
-    grid[tetrominoe[3][0]][tetrominoe[3][1]] = block_colour;
+    idle_acct_mark = rdtsc();
+    acct->idle_cycles += idle_acct_mark - start;
+    acct->halts++;
 }
 
-int get_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+void sched_run()
 {
-    int remove_count = 0;
+    struct task* next;
 
-    for (int y = 0; y < GRID_SIZE_Y; y++) {
-        for (int x = 0; x < GRID_SIZE_X; x++) {
-            if (!grid[x][y]) {
-                goto next_line;
-            }
+    sched_running = 1;
+
+    while (sched_running) {
+        // Interrupts stay off from the check to the hlt so a wake-up cannot
+        // slip in between (sti only takes effect after the next instruction)
+        __asm__ __volatile__("cli" : : : "memory");
+        next = sched_pick();
+
+        if (!next) {
+            idle_halt();
+            continue;
         }
 
-        remove_lines[remove_count++] = y;
+        __asm__ __volatile__("sti" : : : "memory");
 
-        next_line:
-        continue;
+        next->state = TASK_READY;
+        sched_last = next - tasks;
+        current_task = next;
+        switch_context(&sched_esp, next->esp);
+        current_task = 0;
     }
-
-    return remove_count;
 }
 
-void cycle_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+// Mode 2 (rate generator), read/write latch low then high (lo/hi)
+void pit_set_frequency(uint32_t hz)
 {
-    for (int i = 0; i < 4; i++) {
-        if (remove_lines[i] == -1) { continue; }
-
-        // Cycle the line
-        for (int x = 0; x < GRID_SIZE_X; x++) {
-            if ((grid[x][remove_lines[i]] & 0x00FF) == '#') {
-                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] & 0xFF20;
-            } else {
-                grid[x][remove_lines[i]] = grid[x][remove_lines[i]] | '#';
-            }
+    if (hz == 0) return;
+    uint32_t divisor = PIT_BASE_HZ / hz;
+    if (divisor == 0) divisor = 1;
+    uint8_t lo = divisor & 0xFF;
+    uint8_t hi = (divisor >> 8) & 0xFF;
+
+    // Command: channel 0, access lobyte/hibyte, mode 2, binary
+    outb(PIT_CMD, 0x34);
+    outb(PIT_CHANNEL0, lo);
+    outb(PIT_CHANNEL0, hi);
+}
+
+// Deferred work (bottom halves)
+// IRQ handlers queue small work items here instead of doing the work with
+// interrupts disabled. The queue is single-producer single-consumer (the
+// deferred task), so head and tail need no lock. Single producer only holds
+// because every IRQ that defers work is taken on the BSP, where interrupt
+// gates do not nest: those IRQs are listed in DEFERRED_IRQS, and
+// ioapic_route_irq() refuses to send them to another CPU.
+#define DEFERRED_QUEUE_SIZE 64 // Must be a power of two
+#define DEFERRED_IRQS (1 << 1) // Keyboard
+
+typedef void (*deferred_fn_t)(uint32_t arg);
+
+struct deferred_item
+{
+    deferred_fn_t fn;
+    uint32_t arg;
+};
+
+static struct deferred_item deferred_queue[DEFERRED_QUEUE_SIZE];
+static volatile uint32_t deferred_head = 0; // Next slot to fill, IRQ side
+static volatile uint32_t deferred_tail = 0; // Next slot to run, deferred task side
+static volatile uint32_t deferred_dropped = 0;
+
+// Queue fn(arg) to run later with interrupts enabled. Call from IRQ context
+// (or with interrupts disabled). Returns 0 if the queue is full.
+int defer_work(deferred_fn_t fn, uint32_t arg)
+{
+    uint32_t head = deferred_head;
+
+    if (head - __atomic_load_n(&deferred_tail, __ATOMIC_ACQUIRE) >= DEFERRED_QUEUE_SIZE) {
+        deferred_dropped++;
+        return 0;
+    }
+
+    deferred_queue[head & (DEFERRED_QUEUE_SIZE - 1)].fn = fn;
+    deferred_queue[head & (DEFERRED_QUEUE_SIZE - 1)].arg = arg;
+    __atomic_store_n(&deferred_head, head + 1, __ATOMIC_RELEASE);
+    task_signal_all(EVENT_DEFERRED);
+
+    return 1;
+}
+
+// Drain the queue. Only runs the items present on entry so a handler that
+// keeps re-queueing work cannot starve the caller.
+void run_deferred_work()
+{
+    uint32_t tail = deferred_tail;
+    uint32_t head = __atomic_load_n(&deferred_head, __ATOMIC_ACQUIRE);
+    struct deferred_item item;
+
+    while (tail != head) {
+        item = deferred_queue[tail & (DEFERRED_QUEUE_SIZE - 1)];
+        tail++;
+        __atomic_store_n(&deferred_tail, tail, __ATOMIC_RELEASE);
+
+        item.fn(item.arg);
+    }
+}
+
+// C handler called from IRQ wrapper
+void pit_tick_handler_c(void)
+{
+    ticks_count++;
+    game_ticks += game_speed;
+    task_signal_all(EVENT_TICK);
+
+    // send EOI (PIC or local APIC)
+    irq_send_eoi(0);
+}
+
+// Queue a scancode for read_keyb(). Only called from task context, by the
+// keyboard's bottom half and keyb_inject(), so the two never interleave.
+static void keyb_push(uint8_t scancode)
+{
+    uint32_t head = keyb_head;
+
+    // Drop the scancode if the input task has fallen a full buffer behind
+    if (head - keyb_tail < KEYB_BUFFER_SIZE) {
+        keyb_buffer[head & (KEYB_BUFFER_SIZE - 1)] = scancode;
+        __atomic_store_n(&keyb_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Bottom half of the keyboard IRQ, run by the deferred task
+static void keyb_deferred(uint32_t scancode)
+{
+    keyb_real_last = scancode;
+    keyb_real_count++;
+    keyb_push(scancode);
+
+    task_signal_all(EVENT_KEYB);
+}
+
+// Only the port read is urgent; the rest waits for the bottom half
+void keyb_handler_c()
+{
+    uint8_t scancode = inb(0x60);
+
+    defer_work(keyb_deferred, scancode);
+    irq_send_eoi(1);
+}
+
+// Feed a scancode through the same path as a key from the keyboard
+static void keyb_inject(uint8_t scancode)
+{
+    keyb_push(scancode);
+    task_signal_all(EVENT_KEYB);
+}
+
+typedef void (*irq_handler_t)(void);
+static irq_handler_t irq_handlers[16];
+
+void register_irq_handler(int irq, void (*handler)(void))
+{
+    if (irq < 0 || irq > 15) return;
+    irq_handlers[irq] = handler;
+}
+
+// Initialize PIT and register handler
+void pit_init(uint32_t hz)
+{
+    disable_interrupts();
+    pic_remap();              // remap PIC if not already done
+    pit_set_frequency(hz);
+    pit_hz = hz;
+    register_irq_handler(0, pit_tick_handler_c); // IRQ0 -> handler
+    enable_interrupts();
+}
+
+void keyb_init()
+{
+    disable_interrupts();
+    register_irq_handler(1, keyb_handler_c);
+    enable_interrupts();
+}
+
+struct idt_entry
+{
+    uint16_t offset_low;
+    uint16_t sel;
+    uint8_t  zero;
+    uint8_t  flags;
+    uint16_t offset_high;
+} __attribute__((packed));
+
+struct idtr
+{
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+static struct idt_entry idt[IDT_SIZE];
+static struct idtr idtr;
+
+extern void irq0_stub(void); // defined in assembly
+extern void irq1_stub(void); // defined in assembly
+extern void ipi_wake_stub(void); // defined in assembly
+extern void spurious_stub(void); // defined in assembly
+
+static void set_idt_entry(int vector, void (*isr)(), uint16_t sel, uint8_t flags)
+{
+    uint32_t addr = (uint32_t)isr;
+    idt[vector].offset_low = addr & 0xFFFF;
+    idt[vector].sel = sel;
+    idt[vector].zero = 0;
+    idt[vector].flags = flags; // Interrupt 0x8E, Trap 0x8F, Task 0x85
+    idt[vector].offset_high = (addr >> 16) & 0xFFFF;
+}
+
+void idt_init()
+{
+    for (int i = 0; i < IDT_SIZE; ++i) {
+        set_idt_entry(i, 0, 0x08, 0x8E); // default entries (null handler)
+    }
+    // install IRQ0 at vector 0x20
+    set_idt_entry(0x20, irq0_stub, 0x08, 0x8E);
+    set_idt_entry(0x21, irq1_stub, 0x08, 0x8E);
+    // local APIC vectors, see smp_init
+    set_idt_entry(0x40, ipi_wake_stub, 0x08, 0x8E);
+    set_idt_entry(0xFF, spurious_stub, 0x08, 0x8E);
+
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)&idt;
+    __asm__ __volatile__("lidtl (%0)" : : "r" (&idtr));
+}
+
+// Interrupt-off time per IRQ line, measured around the C handler
+struct irq_stats
+{
+    uint32_t count;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+};
+
+static struct irq_stats irq_stats[16];
+
+// Called from assembly ISR wrapper
+void irq_dispatch(int irq)
+{
+    uint64_t start = rdtsc();
+    uint32_t cycles;
+
+    if (irq_handlers[irq]) irq_handlers[irq]();
+
+    cycles = (uint32_t)(rdtsc() - start);
+    irq_stats[irq].count++;
+    irq_stats[irq].total_cycles += cycles;
+    if (cycles > irq_stats[irq].max_cycles) irq_stats[irq].max_cycles = cycles;
+}
+
+// Print the interrupt-off time per IRQ line and the deferred work lost to a
+// full queue over serial
+void irq_report_serial()
+{
+    uint64_t total;
+
+    for (int i = 0; i < 16; i++) {
+        if (irq_stats[i].count == 0) continue;
+
+        total = irq_stats[i].total_cycles;
+        div64_32(&total, irq_stats[i].count);
+
+        serial_printf("irq line=%d count=%u avg_cycles=%u max_cycles=%u\n",
+            i, irq_stats[i].count, (uint32_t)total, irq_stats[i].max_cycles);
+    }
+
+    serial_printf("deferred dropped=%u\n", deferred_dropped);
+}
+
+// Concurrency primitives for cross-CPU work
+// Ticket spinlocks for the rare shared structure, a bounded MPMC job queue
+// (sequence-numbered cells, no locks) shared by all CPUs, and single
+// producer / single consumer rings used as per-CPU mailboxes.
+struct spinlock
+{
+    volatile uint16_t next;  // Next ticket to hand out
+    volatile uint16_t owner; // Ticket now holding the lock
+};
+
+static inline void spin_lock(struct spinlock* lock)
+{
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ __volatile__ ("pause");
+    }
+}
+
+static inline void spin_unlock(struct spinlock* lock)
+{
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+struct job
+{
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+#define JOB_QUEUE_SIZE 64 // Must be a power of two
+
+struct mpmc_cell
+{
+    volatile uint32_t seq;
+    struct job job;
+};
+
+struct mpmc_queue
+{
+    struct mpmc_cell cells[JOB_QUEUE_SIZE];
+    volatile uint32_t enqueue_pos __attribute__((aligned(64)));
+    volatile uint32_t dequeue_pos __attribute__((aligned(64)));
+};
+
+void mpmc_init(struct mpmc_queue* q)
+{
+    for (uint32_t i = 0; i < JOB_QUEUE_SIZE; i++) {
+        q->cells[i].seq = i;
+    }
+
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+}
+
+// Returns 0 if the queue is full
+int mpmc_push(struct mpmc_queue* q, struct job* job)
+{
+    uint32_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    struct mpmc_cell* cell;
+    int32_t diff;
+
+    for (;;) {
+        cell = &q->cells[pos & (JOB_QUEUE_SIZE - 1)];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->job = *job;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// Returns 0 if the queue is empty
+int mpmc_pop(struct mpmc_queue* q, struct job* job)
+{
+    uint32_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    struct mpmc_cell* cell;
+    int32_t diff;
+
+    for (;;) {
+        cell = &q->cells[pos & (JOB_QUEUE_SIZE - 1)];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *job = cell->job;
+    __atomic_store_n(&cell->seq, pos + JOB_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static inline int mpmc_empty(struct mpmc_queue* q)
+{
+    uint32_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    return (int32_t)(__atomic_load_n(&q->cells[pos & (JOB_QUEUE_SIZE - 1)].seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0;
+}
+
+#define MAILBOX_SIZE 32 // Must be a power of two
+
+struct spsc_ring
+{
+    struct job slots[MAILBOX_SIZE];
+    volatile uint32_t head __attribute__((aligned(64))); // Producer side
+    volatile uint32_t tail __attribute__((aligned(64))); // Consumer side
+};
+
+// Returns 0 if the ring is full
+int spsc_push(struct spsc_ring* ring, struct job* job)
+{
+    uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= MAILBOX_SIZE) {
+        return 0;
+    }
+
+    ring->slots[head & (MAILBOX_SIZE - 1)] = *job;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// Returns 0 if the ring is empty
+int spsc_pop(struct spsc_ring* ring, struct job* job)
+{
+    uint32_t tail = ring->tail;
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    *job = ring->slots[tail & (MAILBOX_SIZE - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static inline int spsc_empty(struct spsc_ring* ring)
+{
+    return ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+// Paging
+// Optional identity map of all 4 GB with 4 MB (PSE) pages, except the first
+// 4 MB which get a page table so the VGA window can be marked
+// write-combining through the PAT. Everything else is WB in the PAT and left
+// to the BIOS MTRRs, which already keep MMIO uncached. PAGING=0 ./build.sh
+// leaves paging off.
+#ifndef PAGING
+#define PAGING 1
+#endif
+
+#define PAGE_SIZE 4096
+#define PTE_PRESENT 0x001
+#define PTE_WRITE   0x002
+#define PTE_PWT     0x008
+#define PTE_PCD     0x010
+#define PDE_PSE     0x080 // 4 MB page
+
+// PA0 WB, PA1 WC, PA2 UC-, PA3 UC and the same again for PA4-7, so PWT alone
+// selects write-combining and PCD|PWT uncached
+#define MSR_PAT 0x277
+#define PAT_VALUE 0x0007010600070106ULL
+#define PTE_WC PTE_PWT
+#define PTE_UC (PTE_PCD | PTE_PWT)
+
+#define VGA_WINDOW_START 0xA0000
+#define VGA_WINDOW_END   0xC0000
+#define PRESENT_BENCH_ROUNDS 8
+
+static uint32_t page_directory[1024] __attribute__((aligned(4096)));
+static uint32_t low_page_table[1024] __attribute__((aligned(4096)));
+static int paging_enabled = 0;
+static int vram_wc = 0;
+
+// Drain the write-combining buffers so VRAM stores reach the screen
+static inline void wc_flush()
+{
+    __asm__ __volatile__ ("lock; addl $0, (%%esp)" : : : "memory");
+}
+
+// Load the PAT and the page directory and turn paging on for the calling CPU.
+// The APs call this from ap_main() once the BSP has built the tables.
+void paging_cpu_enable()
+{
+    __asm__ __volatile__ ("wbinvd" : : : "memory");
+    wrmsr(MSR_PAT, PAT_VALUE);
+
+    __asm__ __volatile__ (
+        "movl %%cr4, %%eax\n\t"
+        "orl $0x10, %%eax\n\t"        // CR4.PSE
+        "movl %%eax, %%cr4\n\t"
+        "movl %0, %%cr3\n\t"
+        "movl %%cr0, %%eax\n\t"
+        "orl $0x80000000, %%eax\n\t"  // CR0.PG
+        "movl %%eax, %%cr0"
+        : : "r"(page_directory) : "eax", "memory");
+}
+
+// Map the VGA window with the given PAT bits
+static void vram_set_cache(uint32_t bits)
+{
+    for (uint32_t addr = VGA_WINDOW_START; addr < VGA_WINDOW_END; addr += PAGE_SIZE) {
+        low_page_table[addr / PAGE_SIZE] = addr | bits | PTE_WRITE | PTE_PRESENT;
+    }
+
+    // Drop the old TLB entries, and any lines cached under the old type
+    __asm__ __volatile__ (
+        "movl %%cr3, %%eax\n\t"
+        "movl %%eax, %%cr3\n\t"
+        "wbinvd"
+        : : : "eax", "memory");
+
+    vram_wc = (bits == PTE_WC);
+}
+
+// Average TSC cycles to write every cell of the text screen
+static uint32_t present_benchmark()
+{
+    uint64_t start = rdtsc();
+    uint64_t cycles;
+
+    for (int round = 0; round < PRESENT_BENCH_ROUNDS; round++) {
+        for (int i = 0; i < 2000; i++) {
+            VGA[i] = 0x0700 | ' ';
+        }
+        wc_flush();
+    }
+
+    cycles = rdtsc() - start;
+    div64_32(&cycles, PRESENT_BENCH_ROUNDS);
+
+    return (uint32_t)cycles;
+}
+
+// Identity-map memory, make VRAM write-combining and turn paging on, logging
+// the cost of a full-screen present without paging, uncached and
+// write-combined. Returns 0 if paging stays off.
+int paging_init()
+{
+    uint32_t a, b, c, d;
+    uint32_t flat;
+    uint32_t uc;
+    uint32_t wc;
+
+    if (!PAGING) return 0;
+
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 3)) || !(d & (1 << 16))) {
+        serial_printf("paging off, no PSE or PAT\n");
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        low_page_table[i] = (i * PAGE_SIZE) | PTE_WRITE | PTE_PRESENT;
+        page_directory[i] = (i << 22) | PDE_PSE | PTE_WRITE | PTE_PRESENT;
+    }
+    page_directory[0] = (uint32_t)low_page_table | PTE_WRITE | PTE_PRESENT;
+
+    flat = present_benchmark();
+
+    paging_cpu_enable();
+    paging_enabled = 1;
+
+    vram_set_cache(PTE_UC);
+    uc = present_benchmark();
+    vram_set_cache(PTE_WC);
+    wc = present_benchmark();
+
+    serial_printf("paging present_cycles flat=%u uc=%u wc=%u\n", flat, uc, wc);
+
+    return 1;
+}
+
+// SMP bring-up
+// Application processors are started with INIT-SIPI-SIPI through the local
+// APIC. Each one enters ap_trampoline.asm in real mode, switches to
+// protected mode, claims a cpus[] slot and stack, and lands in ap_main()
+// where it waits for jobs (see smp_post() and smp_submit()).
+// Every CPU (the BSP included) runs on its own GDT whose selector 0x18 maps
+// the CPU's struct cpu, so this_cpu() is a single %fs load.
+#define MAX_CPUS 8
+#define AP_STACK_SIZE 8192
+#define AP_TRAMPOLINE_ADDR 0x8000 // Must match ap_trampoline.asm
+
+#define GDT_ENTRIES 7
+#define GDT_PERCPU_SEL 0x18
+#define GDT_TSS_SEL 0x20      // The CPU's own task, saved into on a fault
+#define GDT_PF_TSS_SEL 0x28   // Page fault task
+#define GDT_DF_TSS_SEL 0x30   // Double fault task
+#define FAULT_STACK_SIZE 2048
+
+// 32-bit task state segment. Only used for the fault tasks: a task gate
+// switches to a fresh stack, which a fault on an overflowed stack needs.
+struct tss
+{
+    uint32_t link;
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap;
+    uint16_t iomap;
+} __attribute__((packed));
+
+struct gdtr
+{
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+struct cpu
+{
+    struct cpu* self; // Must stay first, this_cpu() reads %fs:0
+    int id;
+    uint8_t apic_id;
+    volatile int online;
+
+    uint64_t gdt[GDT_ENTRIES];
+    struct gdtr gdtr;
+    struct tss tss;
+    struct tss fault_tss[2]; // Page fault, double fault
+
+    // Jobs posted to this CPU by the BSP, and finished jobs going back
+    struct spsc_ring inbox;
+    struct spsc_ring outbox;
+    volatile int idle; // Set while halted, producers send a wake IPI
+    uint64_t online_tsc;
+    uint64_t idle_cycles;
+} __attribute__((aligned(64)));
+
+static struct cpu cpus[MAX_CPUS];
+static int cpu_count = 1;
+static struct mpmc_queue smp_jobs; // Shared queue any AP may take from
+static int smp_collect_next = 1;
+
+static uint8_t ap_stacks[MAX_CPUS][AP_STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t fault_stacks[MAX_CPUS][2][FAULT_STACK_SIZE] __attribute__((aligned(16)));
+
+// Shared with ap_trampoline.asm
+volatile uint32_t ap_boot_next = 1;
+uint32_t ap_boot_max = MAX_CPUS;
+uint32_t ap_stack_tops[MAX_CPUS];
+
+extern char ap_trampoline_start[]; // defined in assembly
+extern char ap_trampoline_end[];   // defined in assembly
+
+static inline struct cpu* this_cpu()
+{
+    struct cpu* cpu;
+    __asm__ __volatile__ ("movl %%fs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Wait at least n full PIT ticks. Needs interrupts enabled.
+static void wait_ticks(uint32_t n)
+{
+    uint64_t end = ticks_count + n + 1;
+
+    while (ticks_count < end) {
+        __asm__ __volatile__ ("hlt");
+    }
+}
+
+static void gdt_set_entry(uint64_t* entry, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags)
+{
+    *entry = (limit & 0xFFFF)
+        | ((uint64_t)(base & 0xFFFFFF) << 16)
+        | ((uint64_t)access << 40)
+        | ((uint64_t)((limit >> 16) & 0x0F) << 48)
+        | ((uint64_t)(flags & 0x0F) << 52)
+        | ((uint64_t)(base >> 24) << 56);
+}
+
+static void page_fault_task();
+static void double_fault_task();
+
+// Fill in a fault task: interrupts off, flat segments plus the per-CPU one,
+// and the top of its own stack
+static void fault_tss_init(struct cpu* cpu, int which, void (*entry)())
+{
+    struct tss* tss = &cpu->fault_tss[which];
+    uint32_t cr3;
+
+    __asm__ __volatile__ ("movl %%cr3, %0" : "=r"(cr3));
+
+    memset(tss, 0, sizeof(*tss));
+    tss->cr3 = cr3;
+    tss->eip = (uint32_t)entry;
+    tss->eflags = 0x2;
+    tss->esp = (uint32_t)&fault_stacks[cpu->id][which][FAULT_STACK_SIZE];
+    tss->cs = 0x08;
+    tss->ss = tss->ds = tss->es = tss->gs = 0x10;
+    tss->fs = GDT_PERCPU_SEL;
+    tss->iomap = sizeof(struct tss);
+}
+
+// Build this CPU's GDT (flat code and data, the per-CPU segment and the task
+// state segments for fault_init()) and switch every segment register and the
+// task register over to it
+static void cpu_load_gdt(struct cpu* cpu)
+{
+    cpu->tss.iomap = sizeof(struct tss);
+    fault_tss_init(cpu, 0, page_fault_task);
+    fault_tss_init(cpu, 1, double_fault_task);
+
+    gdt_set_entry(&cpu->gdt[0], 0, 0, 0, 0);
+    gdt_set_entry(&cpu->gdt[1], 0, 0xFFFFF, 0x9A, 0xC); // code: base=0, limit=4GB
+    gdt_set_entry(&cpu->gdt[2], 0, 0xFFFFF, 0x92, 0xC); // data: base=0, limit=4GB
+    gdt_set_entry(&cpu->gdt[3], (uint32_t)cpu, sizeof(struct cpu) - 1, 0x92, 0x4);
+    // 32-bit TSS, available (ltr marks it busy)
+    gdt_set_entry(&cpu->gdt[4], (uint32_t)&cpu->tss, sizeof(struct tss) - 1, 0x89, 0x0);
+    gdt_set_entry(&cpu->gdt[5], (uint32_t)&cpu->fault_tss[0], sizeof(struct tss) - 1, 0x89, 0x0);
+    gdt_set_entry(&cpu->gdt[6], (uint32_t)&cpu->fault_tss[1], sizeof(struct tss) - 1, 0x89, 0x0);
+
+    cpu->gdtr.limit = sizeof(cpu->gdt) - 1;
+    cpu->gdtr.base = (uint32_t)&cpu->gdt;
+
+    __asm__ __volatile__ (
+        "lgdtl (%0)\n\t"
+        "ljmp $0x08, $1f\n"
+        "1:\n\t"
+        "movw $0x10, %%ax\n\t"
+        "movw %%ax, %%ds\n\t"
+        "movw %%ax, %%es\n\t"
+        "movw %%ax, %%ss\n\t"
+        "movw %%ax, %%gs\n\t"
+        "movw %1, %%ax\n\t"
+        "movw %%ax, %%fs\n\t"
+        "movw %2, %%ax\n\t"
+        "ltr %%ax\n\t"
+        : : "r"(&cpu->gdtr), "i"(GDT_PERCPU_SEL), "i"(GDT_TSS_SEL) : "eax", "memory");
+}
+
+// Report a page fault or double fault and stop this CPU. Runs as its own
+// task, so the faulting state is in the task it came from and the CPU pushed
+// the error code at the top of this task's stack.
+static void fault_report(const char* name, int which)
+{
+    struct cpu* cpu = this_cpu();
+    struct tss* from = &cpu->tss;
+    uint32_t error = *(uint32_t*)&fault_stacks[cpu->id][which][FAULT_STACK_SIZE - 4];
+    uint32_t cr2;
+
+    __asm__ __volatile__ ("clts; movl %%cr2, %0" : "=r"(cr2)); // The task switch set CR0.TS
+
+    if (cpu->fault_tss[which].link == GDT_PF_TSS_SEL) from = &cpu->fault_tss[0];
+
+    serial_printf("fault %s cpu=%d cr2=0x%x eip=0x%x esp=0x%x error=0x%x\n",
+        name, cpu->id, cr2, from->eip, from->esp, error);
+
+    if (cr2 >> 12 == BOOT_STACK_GUARD >> 12) {
+        serial_printf("stack overflow name=boot\n");
+    }
+
+    for (;;) {
+        __asm__ __volatile__ ("cli; hlt");
+    }
+}
+
+static void page_fault_task()
+{
+    fault_report("page", 0);
+}
+
+static void double_fault_task()
+{
+    fault_report("double", 1);
+}
+
+// Send #PF and #DF through task gates to the fault tasks, then unmap the
+// page under the boot stack. An overflow into it faults with ESP in the
+// guard, where the CPU could not even push the fault's frame, so the
+// handlers must not run on the faulting stack.
+void fault_init()
+{
+    cpus[0].self = &cpus[0];
+    cpus[0].id = 0;
+    cpu_load_gdt(&cpus[0]);
+
+    set_idt_entry(8, 0, GDT_DF_TSS_SEL, 0x85);
+    set_idt_entry(14, 0, GDT_PF_TSS_SEL, 0x85);
+
+    if (paging_enabled) {
+        low_page_table[BOOT_STACK_GUARD / PAGE_SIZE] = 0;
+        __asm__ __volatile__ ("invlpg (%0)" : : "r"(BOOT_STACK_GUARD) : "memory");
+    }
+}
+
+static volatile uint32_t ipi_wake_count = 0;
+
+void ipi_wake_handler_c()
+{
+    ipi_wake_count++;
+    lapic_eoi();
+}
+
+static int ap_has_work(struct cpu* cpu)
+{
+    return !spsc_empty(&cpu->inbox) || !mpmc_empty(&smp_jobs);
+}
+
+// AP worker loop: run jobs from this CPU's mailbox first, then from the
+// shared queue, posting each one to the outbox when done. Halts when both
+// are empty. idle is published before the final check (xchg is a full
+// barrier) so a producer either sees it set or its job is seen here.
+static void ap_worker(struct cpu* cpu)
+{
+    struct job job;
+    uint64_t idle_start;
+
+    for (;;) {
+        if (spsc_pop(&cpu->inbox, &job) || mpmc_pop(&smp_jobs, &job)) {
+            job.fn(job.arg);
+
+            while (!spsc_push(&cpu->outbox, &job)) {
+                __asm__ __volatile__ ("pause");
+            }
+
+            continue;
+        }
+
+        disable_interrupts();
+        __atomic_exchange_n(&cpu->idle, 1, __ATOMIC_SEQ_CST);
+
+        if (ap_has_work(cpu)) {
+            cpu->idle = 0;
+            enable_interrupts();
+            continue;
+        }
+
+        idle_start = rdtsc();
+        __asm__ __volatile__ ("sti; hlt" : : : "memory");
+        cpu->idle_cycles += rdtsc() - idle_start;
+        cpu->idle = 0;
+    }
+}
+
+static void smp_wake(struct cpu* cpu)
+{
+    if (__atomic_load_n(&cpu->idle, __ATOMIC_SEQ_CST)) {
+        lapic_send_ipi(cpu->apic_id, ICR_ASSERT | IPI_WAKE_VECTOR);
+    }
+}
+
+// C entry for application processors, called from ap_trampoline.asm
+void ap_main(int id)
+{
+    struct cpu* cpu = &cpus[id];
+
+    if (paging_enabled) paging_cpu_enable();
+
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu_load_gdt(cpu);
+    __asm__ __volatile__ ("lidtl (%0)" : : "r" (&idtr));
+
+    lapic_enable();
+    cpu->apic_id = lapic_id();
+    cpu->online_tsc = rdtsc();
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+
+    ap_worker(cpu);
+}
+
+// Post a job to one AP's mailbox. Only the BSP may post. Returns 0 if the
+// CPU is offline or its mailbox is full.
+int smp_post(int id, struct job* job)
+{
+    struct cpu* cpu = &cpus[id];
+
+    if (id <= 0 || id >= MAX_CPUS || !cpu->online || !spsc_push(&cpu->inbox, job)) {
+        return 0;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    smp_wake(cpu);
+
+    return 1;
+}
+
+// Queue a job for whichever AP gets to it first. Returns 0 if there are no
+// APs or the queue is full; the caller should then run the job itself.
+int smp_submit(struct job* job)
+{
+    if (cpu_count == 1 || !mpmc_push(&smp_jobs, job)) {
+        return 0;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Claim a halted AP by clearing its idle flag, so that jobs submitted
+    // back to back wake different APs instead of the same one over and over
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (cpus[i].online && __atomic_exchange_n(&cpus[i].idle, 0, __ATOMIC_SEQ_CST)) {
+            lapic_send_ipi(cpus[i].apic_id, ICR_ASSERT | IPI_WAKE_VECTOR);
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// Fetch one finished job from the APs' outboxes without blocking. Only the
+// BSP may collect. Returns 0 if nothing has finished.
+int smp_collect(struct job* job)
+{
+    int id;
+
+    for (int n = 1; n < MAX_CPUS; n++) {
+        id = smp_collect_next;
+        smp_collect_next = smp_collect_next % (MAX_CPUS - 1) + 1;
+
+        if (cpus[id].online && spsc_pop(&cpus[id].outbox, job)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void smp_init()
+{
+    uint32_t a, b, c, d;
+    struct cpu* bsp = &cpus[0];
+
+    bsp->self = bsp;
+    bsp->id = 0;
+    bsp->online = 1;
+
+    disable_interrupts();
+    cpu_load_gdt(bsp);
+    enable_interrupts();
+
+    // No local APIC, stay uniprocessor
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 9))) {
+        return;
+    }
+
+    lapic = (volatile uint32_t*)(uint32_t)(rdmsr(0x1B) & 0xFFFFF000);
+    lapic_enable();
+    bsp->apic_id = lapic_id();
+    mpmc_init(&smp_jobs);
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        ap_stack_tops[i] = (uint32_t)(ap_stacks[i] + AP_STACK_SIZE);
+        stack_paint(ap_stacks[i], ap_stacks[i] + AP_STACK_SIZE);
+    }
+
+    for (char* src = ap_trampoline_start; src < ap_trampoline_end; src++) {
+        ((char*)AP_TRAMPOLINE_ADDR)[src - ap_trampoline_start] = *src;
+    }
+
+    lapic_send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+    wait_ticks(1); // >= 10 ms
+
+    for (int i = 0; i < 2; i++) {
+        lapic_send_ipi(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+        wait_ticks(1);
+    }
+
+    // Give the APs time to check in
+    wait_ticks(10);
+
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (cpus[i].online) cpu_count++;
+    }
+}
+
+// I/O APIC interrupt routing
+// ioapic_init() finds the I/O APIC through the ACPI MADT (falling back to
+// the default 0xFEC00000), masks both 8259s and routes the legacy IRQs in
+// use to the BSP on their usual vectors. ioapic_route_irq() can then move
+// any ISA IRQ to another CPU or vector. EOIs go to the local APIC.
+#define IOAPIC_DEFAULT_BASE 0xFEC00000
+
+#define IOAPIC_REG_VER   0x01
+#define IOAPIC_REG_REDTBL 0x10
+
+#define REDTBL_ACTIVE_LOW 0x00002000
+#define REDTBL_LEVEL      0x00008000
+#define REDTBL_MASKED     0x00010000
+
+struct acpi_header
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+static volatile uint32_t* ioapic = 0;
+static uint32_t ioapic_gsi_base = 0;
+static uint32_t ioapic_entries = 0;
+
+// Legacy IRQ to GSI mapping and polarity/trigger bits from the MADT
+// interrupt source overrides, identity and edge/active-high by default
+static uint32_t irq_gsi[16];
+static uint32_t irq_flags[16];
+
+static int mem_equal(const void* a, const void* b, uint32_t len)
+{
+    const uint8_t* pa = a;
+    const uint8_t* pb = b;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (pa[i] != pb[i]) return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t acpi_checksum(const void* data, uint32_t len)
+{
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        sum += p[i];
+    }
+
+    return sum;
+}
+
+static const uint8_t* acpi_scan_rsdp(uint32_t start, uint32_t len)
+{
+    for (uint32_t addr = start; addr < start + len; addr += 16) {
+        if (mem_equal((void*)addr, "RSD PTR ", 8) && acpi_checksum((void*)addr, 20) == 0) {
+            return (const uint8_t*)addr;
+        }
+    }
+
+    return 0;
+}
+
+// Find an ACPI table through the RSDP and RSDT. Returns 0 if not found.
+static struct acpi_header* acpi_find_table(const char* signature)
+{
+    const uint8_t* rsdp;
+    struct acpi_header* rsdt;
+    uint32_t* entries;
+    uint32_t count;
+
+    // The RSDP is in the first KB of the EBDA or in the BIOS area
+    rsdp = acpi_scan_rsdp((uint32_t)*(uint16_t*)0x40E << 4, 1024);
+    if (!rsdp) rsdp = acpi_scan_rsdp(0xE0000, 0x20000);
+    if (!rsdp) return 0;
+
+    rsdt = (struct acpi_header*)*(uint32_t*)(rsdp + 16);
+    if (!mem_equal(rsdt->signature, "RSDT", 4)) return 0;
+
+    entries = (uint32_t*)(rsdt + 1);
+    count = (rsdt->length - sizeof(struct acpi_header)) / 4;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct acpi_header* table = (struct acpi_header*)entries[i];
+
+        if (mem_equal(table->signature, signature, 4) && acpi_checksum(table, table->length) == 0) {
+            return table;
+        }
+    }
+
+    return 0;
+}
+
+// Pick up the first I/O APIC and the ISA overrides from the MADT
+static void madt_parse()
+{
+    struct acpi_header* madt = acpi_find_table("APIC");
+    uint8_t* entry;
+    uint8_t* end;
+
+    if (!madt) return;
+
+    entry = (uint8_t*)madt + sizeof(struct acpi_header) + 8; // Skip LAPIC address, flags
+    end = (uint8_t*)madt + madt->length;
+
+    while (entry + 2 <= end && entry[1] >= 2) {
+        switch (entry[0]) {
+            case 1: // I/O APIC
+                if (!ioapic) {
+                    ioapic = (volatile uint32_t*)*(uint32_t*)(entry + 4);
+                    ioapic_gsi_base = *(uint32_t*)(entry + 8);
+                }
+                break;
+
+            case 2: // Interrupt source override
+                if (entry[2] == 0 && entry[3] < 16) {
+                    uint16_t flags = *(uint16_t*)(entry + 8);
+
+                    irq_gsi[entry[3]] = *(uint32_t*)(entry + 4);
+                    irq_flags[entry[3]] = 0;
+                    if ((flags & 0x3) == 0x3) irq_flags[entry[3]] |= REDTBL_ACTIVE_LOW;
+                    if (((flags >> 2) & 0x3) == 0x3) irq_flags[entry[3]] |= REDTBL_LEVEL;
+                }
+                break;
+        }
+
+        entry += entry[1];
+    }
+}
+
+static inline uint32_t ioapic_read(uint32_t reg)
+{
+    ioapic[0] = reg;
+    return ioapic[4];
+}
+
+static inline void ioapic_write(uint32_t reg, uint32_t val)
+{
+    ioapic[0] = reg;
+    ioapic[4] = val;
+}
+
+static int ioapic_pin(int irq)
+{
+    uint32_t pin;
+
+    if (!ioapic || irq < 0 || irq > 15) return -1;
+
+    pin = irq_gsi[irq] - ioapic_gsi_base;
+    if (pin >= ioapic_entries) return -1;
+
+    return pin;
+}
+
+// Deliver legacy IRQ irq to CPU cpu (index into cpus[]) on vector. Returns
+// 0 if there is no I/O APIC, the IRQ has no pin or the CPU is offline, or
+// if the IRQ defers work and cpu is not the BSP (see DEFERRED_IRQS).
+int ioapic_route_irq(int irq, int cpu, uint8_t vector)
+{
+    int pin = ioapic_pin(irq);
+
+    if (pin < 0 || cpu < 0 || cpu >= MAX_CPUS || !cpus[cpu].online) return 0;
+    if (cpu != 0 && (DEFERRED_IRQS & (1 << irq))) return 0;
+
+    // Mask while the entry is half written
+    ioapic_write(IOAPIC_REG_REDTBL + pin * 2, REDTBL_MASKED);
+    ioapic_write(IOAPIC_REG_REDTBL + pin * 2 + 1, (uint32_t)cpus[cpu].apic_id << 24);
+    ioapic_write(IOAPIC_REG_REDTBL + pin * 2, vector | irq_flags[irq]);
+
+    return 1;
+}
+
+void ioapic_mask_irq(int irq)
+{
+    int pin = ioapic_pin(irq);
+
+    if (pin >= 0) ioapic_write(IOAPIC_REG_REDTBL + pin * 2, REDTBL_MASKED);
+}
+
+// Needs smp_init() to have set up the local APIC
+void ioapic_init()
+{
+    uint32_t version;
+
+    if (!lapic) return;
+
+    for (int i = 0; i < 16; i++) {
+        irq_gsi[i] = i;
+        irq_flags[i] = 0;
+    }
+
+    madt_parse();
+    if (!ioapic) ioapic = (volatile uint32_t*)IOAPIC_DEFAULT_BASE;
+
+    version = ioapic_read(IOAPIC_REG_VER);
+    if (version == 0xFFFFFFFF) {
+        ioapic = 0;
+        return;
+    }
+
+    ioapic_entries = ((version >> 16) & 0xFF) + 1;
+
+    disable_interrupts();
+
+    for (uint32_t pin = 0; pin < ioapic_entries; pin++) {
+        ioapic_write(IOAPIC_REG_REDTBL + pin * 2, REDTBL_MASKED);
+    }
+
+    // Mask every line on both 8259s, the I/O APIC takes over
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+
+    ioapic_route_irq(0, 0, 0x20); // PIT
+    ioapic_route_irq(1, 0, 0x21); // Keyboard
+    ioapic_active = 1;
+
+    enable_interrupts();
+}
+
+// Physical memory
+// The RAM map comes from the BIOS E820 list that loader.asm leaves at
+// E820_MAP, or from the Multiboot or PVH start info on a direct boot. Free
+// memory is handed out in 4 KB pages from a bitmap (one bit per page, set
+// when in use) that lives in the first free RAM big enough to hold it.
+#define E820_MAP 0x600 // Entry count, then 24-byte entries from E820_MAP+8
+#define E820_MAX 32
+#define E820_USABLE 1
+
+#define MEM_MAP_MAX 32
+
+struct mem_region
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type; // E820 type, 1 = usable RAM
+};
+
+static struct mem_region mem_map[MEM_MAP_MAX];
+static int mem_map_count = 0;
+
+static uint32_t* page_bitmap = 0;
+static uint32_t page_count = 0;  // Pages covered by the bitmap
+static uint32_t pages_total = 0; // Usable pages handed to the allocator
+static uint32_t pages_used = 0;
+static uint32_t pages_peak = 0;
+static uint32_t page_hint = 0;   // Lowest page that may be free
+static struct spinlock page_lock;
+
+void mem_map_add(uint64_t base, uint64_t length, uint32_t type)
+{
+    if (mem_map_count == MEM_MAP_MAX || !length) return;
+
+    mem_map[mem_map_count].base = base;
+    mem_map[mem_map_count].length = length;
+    mem_map[mem_map_count].type = type;
+    mem_map_count++;
+}
+
+// Copy the RAM map from wherever this boot path left it
+void mem_map_read()
+{
+    uint8_t* info = (uint8_t*)boot_info;
+
+    if (boot_magic == BOOT_MAGIC_MULTIBOOT) {
+        uint32_t flags = *(uint32_t*)info;
+
+        if (flags & (1 << 6)) {
+            // mmap_length, mmap_addr; each entry is preceded by its size
+            uint8_t* entry = (uint8_t*)*(uint32_t*)(info + 48);
+            uint8_t* end = entry + *(uint32_t*)(info + 44);
+
+            while (entry < end) {
+                mem_map_add(*(uint64_t*)(entry + 4), *(uint64_t*)(entry + 12), *(uint32_t*)(entry + 20));
+                entry += *(uint32_t*)entry + 4;
+            }
+        } else if (flags & 1) {
+            // Only mem_lower / mem_upper in KB
+            mem_map_add(0, (uint64_t)*(uint32_t*)(info + 4) * 1024, E820_USABLE);
+            mem_map_add(0x100000, (uint64_t)*(uint32_t*)(info + 8) * 1024, E820_USABLE);
+        }
+    } else if (boot_magic == BOOT_MAGIC_PVH) {
+        // hvm_start_info version 1 adds memmap_paddr and memmap_entries
+        if (*(uint32_t*)(info + 4) >= 1) {
+            uint8_t* entry = (uint8_t*)*(uint32_t*)(info + 40);
+            uint32_t entries = *(uint32_t*)(info + 48);
+
+            for (uint32_t i = 0; i < entries; i++, entry += 24) {
+                mem_map_add(*(uint64_t*)entry, *(uint64_t*)(entry + 8), *(uint32_t*)(entry + 16));
+            }
+        }
+    } else {
+        uint32_t entries = *(volatile uint32_t*)E820_MAP;
+        uint8_t* entry = (uint8_t*)(E820_MAP + 8);
+
+        if (entries > E820_MAX) entries = 0;
+
+        for (uint32_t i = 0; i < entries; i++, entry += 24) {
+            mem_map_add(*(uint64_t*)entry, *(uint64_t*)(entry + 8), *(uint32_t*)(entry + 16));
         }
     }
 }
 
-int do_remove_lines(int grid[GRID_SIZE_X][GRID_SIZE_Y], int remove_lines[4])
+static inline int page_is_used(uint32_t page)
+{
+    return (page_bitmap[page / 32] >> (page % 32)) & 1;
+}
+
+// Mark pages [first, first + count) used (used = 1) or free, keeping the
+// counters in step. Caller holds page_lock or runs before the APs.
+static void page_mark(uint32_t first, uint32_t count, int used)
 {
-    int remove_count = 0;
+    for (uint32_t page = first; page < first + count && page < page_count; page++) {
+        if (page_is_used(page) == used) continue;
+
+        if (used) {
+            page_bitmap[page / 32] |= 1u << (page % 32);
+            pages_used++;
+        } else {
+            page_bitmap[page / 32] &= ~(1u << (page % 32));
+            pages_used--;
+        }
+    }
 
-    for (int i = 0; i < 4; i++) {
-        if (remove_lines[i] == -1) { continue; }
+    if (pages_used > pages_peak) pages_peak = pages_used;
+}
+
+// Usable part of a region as whole pages below 4 GB. Returns 0 if none.
+static int region_pages(struct mem_region* region, uint32_t* first, uint32_t* end)
+{
+    uint64_t start = (region->base + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t stop = (region->base + region->length) / PAGE_SIZE;
 
-        remove_count++;
+    if (region->type != E820_USABLE) return 0;
+    if (stop > 0x100000) stop = 0x100000;
+    if (start >= stop) return 0;
 
-        // Remove the line
-        for (int x = 0; x < GRID_SIZE_X; x++) {
-            grid[x][remove_lines[i]] = 0;
+    *first = (uint32_t)start;
+    *end = (uint32_t)stop;
+
+    return 1;
+}
+
+void mem_init()
+{
+    uint32_t reserved_end;
+    uint32_t bitmap_pages;
+    uint32_t first;
+    uint32_t end;
+
+    mem_map_read();
+
+    // Everything below the boot stack top (or the end of .bss, if that is
+    // higher) belongs to the BIOS, the kernel image and the boot stack
+    reserved_end = (uint32_t)__kernel_end;
+    if (reserved_end < BOOT_STACK_TOP) reserved_end = BOOT_STACK_TOP;
+    reserved_end = (reserved_end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for (int i = 0; i < mem_map_count; i++) {
+        if (region_pages(&mem_map[i], &first, &end) && end > page_count) {
+            page_count = end;
         }
+    }
 
-        // Move above lines down
-        for (int y = remove_lines[i]; y != 0; y--) {
-            for (int x = 0; x < GRID_SIZE_X; x++) {
-                grid[x][y] = grid[x][y-1];
-            }
+    bitmap_pages = ((page_count + 31) / 32 * 4 + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // The bitmap goes in the first usable pages above the reserved area
+    for (int i = 0; i < mem_map_count && !page_bitmap; i++) {
+        if (!region_pages(&mem_map[i], &first, &end)) continue;
+        if (first < reserved_end) first = reserved_end;
+        if (first + bitmap_pages > end) continue;
+
+        page_bitmap = (uint32_t*)(first * PAGE_SIZE);
+    }
+
+    if (!page_bitmap) {
+        page_count = 0;
+        serial_printf("mem no usable memory map\n");
+        return;
+    }
+
+    // Start all used, then free the usable regions
+    for (uint32_t i = 0; i < (page_count + 31) / 32; i++) {
+        page_bitmap[i] = 0xFFFFFFFF;
+    }
+    pages_used = page_count;
+
+    for (int i = 0; i < mem_map_count; i++) {
+        if (region_pages(&mem_map[i], &first, &end)) {
+            page_mark(first, end - first, 0);
+        }
+    }
+
+    // Count from here on only what the allocator hands out
+    pages_total = page_count - pages_used;
+    pages_used = 0;
+
+    page_mark(0, reserved_end, 1);
+    page_mark((uint32_t)page_bitmap / PAGE_SIZE, bitmap_pages, 1);
+    pages_peak = pages_used;
+
+    for (int i = 0; i < mem_map_count; i++) {
+        serial_printf("mem region base_kb=%llu size_kb=%llu type=%u\n",
+            mem_map[i].base / 1024, mem_map[i].length / 1024, mem_map[i].type);
+    }
+}
+
+// Allocate count physically contiguous pages. Returns 0 if there is no run
+// that long.
+void* page_alloc(uint32_t count)
+{
+    uint32_t run = 0;
+    void* addr = 0;
+
+    if (!count) return 0;
+
+    spin_lock(&page_lock);
+
+    for (uint32_t page = page_hint; page < page_count; page++) {
+        // Skip full words in one go
+        if (run == 0 && page % 32 == 0 && page_bitmap[page / 32] == 0xFFFFFFFF) {
+            page += 31;
+            continue;
+        }
+
+        if (page_is_used(page)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == count) {
+            page_mark(page + 1 - count, count, 1);
+            if (page_hint == page + 1 - count) page_hint = page + 1;
+            addr = (void*)((page + 1 - count) * PAGE_SIZE);
+            break;
+        }
+    }
+
+    spin_unlock(&page_lock);
+
+    return addr;
+}
+
+void page_free(void* addr, uint32_t count)
+{
+    uint32_t first = (uint32_t)addr / PAGE_SIZE;
+
+    spin_lock(&page_lock);
+
+    page_mark(first, count, 0);
+    if (first < page_hint) page_hint = first;
+
+    spin_unlock(&page_lock);
+}
+
+void mem_report_serial()
+{
+    serial_printf("mem total_kb=%u used_kb=%u free_kb=%u peak_kb=%u\n",
+        pages_total * 4, pages_used * 4, (pages_total - pages_used) * 4, pages_peak * 4);
+}
+
+// Arenas and pools
+// An arena is a bump allocator over pages from page_alloc(); everything in
+// it is freed at once by arena_reset(), or back to a saved arena_mark() by
+// arena_release(). A pool hands out fixed-size objects from an arena with
+// O(1) alloc and free through a free list, and is emptied in one step by
+// pool_reset(). Neither is locked: each has a single owning task or CPU.
+// A pool goes with its arena: after an arena reset, pool_init() it again.
+//
+// game_arena is reset when a new game starts and holds the per-game state
+// sized by the number of CPUs, see attract_alloc(). search_arena holds the
+// bot's transposition table and is never reset.
+#define GAME_ARENA_PAGES 64 // 256 KB
+#define SEARCH_ARENA_PAGES 128 // 512 KB
+#define MAX_ARENAS 8
+#define MAX_POOLS 8
+
+struct arena
+{
+    const char* name;
+    uint8_t* base;
+    uint32_t size;
+    uint32_t used;
+    uint32_t peak;
+};
+
+struct pool
+{
+    const char* name;
+    uint8_t* base;
+    uint32_t object_size;
+    uint32_t capacity;
+    uint32_t fresh;    // Objects below this index have been handed out before
+    void* free_list;   // Freed objects, linked through their first word
+    uint32_t used;
+    uint32_t peak;
+};
+
+static struct arena* arenas[MAX_ARENAS];
+static int arena_count = 0;
+static struct pool* pools[MAX_POOLS];
+static int pool_count = 0;
+
+static struct arena game_arena;
+static struct arena search_arena;
+
+// Back an arena with pages of its own. Returns 0 if the pages could not be
+// had, leaving an arena where every allocation fails.
+int arena_init(struct arena* arena, const char* name, uint32_t pages)
+{
+    arena->name = name;
+    arena->base = page_alloc(pages);
+    arena->size = arena->base ? pages * PAGE_SIZE : 0;
+    arena->used = 0;
+    arena->peak = 0;
+
+    for (int i = 0; i < arena_count; i++) {
+        if (arenas[i] == arena) return arena->base != 0;
+    }
+    if (arena_count < MAX_ARENAS) arenas[arena_count++] = arena;
+
+    return arena->base != 0;
+}
+
+// align must be a power of two. Returns 0 if the arena is full.
+void* arena_alloc(struct arena* arena, uint32_t size, uint32_t align)
+{
+    uint32_t start = (arena->used + align - 1) & ~(align - 1);
+
+    if (start > arena->size || size > arena->size - start) return 0;
+
+    arena->used = start + size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+
+    return arena->base + start;
+}
+
+static inline uint32_t arena_mark(struct arena* arena)
+{
+    return arena->used;
+}
+
+// Free everything allocated since mark was taken
+static inline void arena_release(struct arena* arena, uint32_t mark)
+{
+    arena->used = mark;
+}
+
+static inline void arena_reset(struct arena* arena)
+{
+    arena->used = 0;
+}
+
+// Carve a pool of count objects out of an arena. Returns 0 if it does not
+// fit, leaving an empty pool.
+int pool_init(struct pool* pool, const char* name, struct arena* arena, uint32_t object_size, uint32_t count)
+{
+    if (object_size < sizeof(void*)) object_size = sizeof(void*);
+    object_size = (object_size + 3) & ~3u;
+
+    pool->name = name;
+    pool->object_size = object_size;
+    pool->base = arena_alloc(arena, object_size * count, 4);
+    pool->capacity = pool->base ? count : 0;
+    pool->fresh = 0;
+    pool->free_list = 0;
+    pool->used = 0;
+    pool->peak = 0;
+
+    for (int i = 0; i < pool_count; i++) {
+        if (pools[i] == pool) return pool->base != 0;
+    }
+    if (pool_count < MAX_POOLS) pools[pool_count++] = pool;
+
+    return pool->base != 0;
+}
+
+// Returns 0 if the pool is exhausted
+void* pool_alloc(struct pool* pool)
+{
+    void* object = pool->free_list;
+
+    if (object) {
+        pool->free_list = *(void**)object;
+    } else if (pool->fresh < pool->capacity) {
+        object = pool->base + pool->fresh * pool->object_size;
+        pool->fresh++;
+    } else {
+        return 0;
+    }
+
+    if (++pool->used > pool->peak) pool->peak = pool->used;
+
+    return object;
+}
+
+void pool_free(struct pool* pool, void* object)
+{
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
+    pool->used--;
+}
+
+static inline void pool_reset(struct pool* pool)
+{
+    pool->fresh = 0;
+    pool->free_list = 0;
+    pool->used = 0;
+}
+
+void arena_report_serial()
+{
+    for (int i = 0; i < arena_count; i++) {
+        serial_printf("arena name=%s used=%u peak=%u size=%u\n",
+            arenas[i]->name, arenas[i]->used, arenas[i]->peak, arenas[i]->size);
+    }
+
+    for (int i = 0; i < pool_count; i++) {
+        serial_printf("pool name=%s used=%u peak=%u capacity=%u object_size=%u\n",
+            pools[i]->name, pools[i]->used, pools[i]->peak, pools[i]->capacity, pools[i]->object_size);
+    }
+}
+
+static short curr_frame[2000];
+static short next_frame[2000];
+
+
+void clear_screen()
+{
+    // Clear screen (80x25)
+    for (int y = 0; y < 25; ++y) {
+        for (int x = 0; x < 80; ++x) {
+            VGA[y*80 + x] = 0x0700 | ' ';
         }
+    }
+}
+
+void print_string(char* str, uint16_t colour, int row, int col)
+{
+    int i = 0;
+
+    while (str[i]) {
+        VGA[row*80 + col + i] = colour | (unsigned char)str[i];
+        i++;
+    }
+}
+
+void print_char(char *chr, uint16_t colour, int row, int col)
+{
+    VGA[row*80 + col] = colour | (unsigned char)*chr;
+}
+
+void init_frame_store()
+{
+    for (int i = 0; i < 2000; ++i) {
+        curr_frame[i] = 0x0700;
+        next_frame[i] = 0x0700;
+    }
+}
+
+void draw_next_frame()
+{
+    for (int i = 0; i < 2000; ++i) {
+        if (curr_frame[i] != next_frame[i]) {
+            curr_frame[i] = next_frame[i];
 
-        remove_lines[i] = -1;
+            VGA[i] = curr_frame[i];
+        }
     }
 
-    return remove_count;
+    if (vram_wc) wc_flush();
+}
+
+static inline uint8_t get_rtc_register(int reg)
+{
+    outb(0x70, reg);
+    return inb(0x71);
 }
 
 void set_numbers_display(int pos_x, int pos_y, char numbers[10], int value)
@@ -674,64 +2327,258 @@ void set_numbers_display(int pos_x, int pos_y, char numbers[10], int value)
 
 }
 
-void tetris()
+static struct game game;
+static struct bot attract_bot;
+static struct lookahead attract_round;
+static struct lookahead_scratch* attract_scratch[MAX_CPUS]; // By CPU id, from game_arena
+static struct pool attract_scratch_pool;
+static struct tt search_tt;
+
+// Engine HAL, see engine.h
+uint64_t hal_ticks()
 {
-    clear_screen();
+    return game_ticks;
+}
+
+void hal_show_counters(struct game* game)
+{
+    set_numbers_display(GRID_SIZE_X+13, 7, game->numbers, game->lines);
+    set_numbers_display(GRID_SIZE_X+13, 8, game->numbers, game->level);
+    set_numbers_display(GRID_SIZE_X+13, 9, game->numbers, game->score);
+}
+
+void hal_show_state(struct game* game)
+{
+    switch (game->state) {
+        case STATE_PAUSED:
+            print_string("PAUSED", 0x0200, 11, GRID_SIZE_X+6);
+            break;
+
+        case STATE_GAME_OVER:
+            print_string("GAME OVER", 0x0400, 12, GRID_SIZE_X+6);
+            break;
 
-    int quit = 0;
-    int pause = 0;
-    int left = 0;
-    int right = 0;
-    int up = 0;
-    int down = 0;
-    int key_pressed = 0;
-    int down_pressed = 0;
+        default:
+            print_string("      ", 0x0200, 11, GRID_SIZE_X+6);
+            break;
+    }
+}
+
+// Memory budget
+// What the kernel image and its larger tables take, against the room left
+// below the boot stack guard, and how deep each stack has gone.
+struct budget_item
+{
+    const char* name;
+    uint32_t bytes;
+};
+
+void budget_report_serial()
+{
+    uint32_t arena_bytes = 0;
+
+    for (int i = 0; i < arena_count; i++) {
+        arena_bytes += arenas[i]->size;
+    }
+
+    struct budget_item items[] = {
+        { "text", (uint32_t)(__rodata_start - __text_start) },
+        { "rodata", (uint32_t)(__data_start - __rodata_start) },
+        { "data", (uint32_t)(__bss_start - __data_start) },
+        { "bss", (uint32_t)(__bss_end - __bss_start) },
+        { "task_stacks", sizeof(task_stacks) },
+        { "ap_stacks", sizeof(ap_stacks) },
+        { "cpus", sizeof(cpus) },
+        { "idt", sizeof(idt) },
+        { "frames", sizeof(curr_frame) + sizeof(next_frame) },
+        { "page_tables", sizeof(page_directory) + sizeof(low_page_table) },
+        { "game", sizeof(game) },
+        { "attract_bot", sizeof(attract_bot) },
+        { "lookahead", sizeof(attract_round) },
+        { "page_bitmap", (page_count + 31) / 32 * 4 },
+        { "arenas", arena_bytes },
+    };
+
+    // The first four are sections of the image, the rest are subsystems
+    for (uint32_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+        serial_printf("budget %s=%s bytes=%u\n", i < 4 ? "section" : "object", items[i].name, items[i].bytes);
+    }
+
+    serial_printf("budget kernel_end=0x%x limit=0x%x free=%u\n",
+        (uint32_t)__kernel_end, BOOT_STACK_GUARD, BOOT_STACK_GUARD - (uint32_t)__kernel_end);
+}
+
+void stack_report_serial()
+{
+    serial_printf("stack name=boot used=%u size=%u\n",
+        stack_high_water((uint8_t*)(BOOT_STACK_TOP - BOOT_STACK_SIZE), BOOT_STACK_SIZE), BOOT_STACK_SIZE);
+
+    for (int i = 0; i < MAX_TASKS; i++) {
+        if (tasks[i].state == TASK_UNUSED) continue;
+
+        serial_printf("stack name=%s used=%u size=%u\n",
+            tasks[i].name, stack_high_water(task_stacks[i], TASK_STACK_SIZE), TASK_STACK_SIZE);
+    }
+
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (!cpus[i].online) continue;
+
+        serial_printf("stack name=ap%d used=%u size=%u\n",
+            i, stack_high_water(ap_stacks[i], AP_STACK_SIZE), AP_STACK_SIZE);
+    }
+}
+
+// Stop everything if a stack has run through its canary, before the damage
+// below it spreads
+void stack_check()
+{
+    const char* overflowed = 0;
+
+    if (!stack_intact((uint8_t*)(BOOT_STACK_TOP - BOOT_STACK_SIZE))) {
+        overflowed = "boot";
+    }
+
+    for (int i = 0; i < MAX_TASKS; i++) {
+        if (tasks[i].state != TASK_UNUSED && !stack_intact(task_stacks[i])) {
+            overflowed = tasks[i].name;
+        }
+    }
+
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (cpus[i].online && !stack_intact(ap_stacks[i])) {
+            overflowed = "ap";
+        }
+    }
+
+    if (!overflowed) return;
+
+    disable_interrupts();
+    serial_printf("stack overflow name=%s\n", overflowed);
+    print_string("STACK OVERFLOW", 0x0400, 14, GRID_SIZE_X+6);
+
+    for (;;) {
+        __asm__ __volatile__("hlt");
+    }
+}
+
+// Boot timeline
+// TSC checkpoints from reset to the first frame. loader.asm and lz4_stub.asm
+// leave theirs in fixed slots at BOOT_TSC_SLOTS; the kernel records its own
+// with boot_mark(). Each phase runs from the previous checkpoint to its own.
+#define BOOT_TSC_SLOTS 0x520
+
+#define BOOT_PHASE_LOADER_START 0 // Slot 0, written by loader.asm
+#define BOOT_PHASE_LOADER_READ  1 // Slot 1, written by loader.asm
+#define BOOT_PHASE_LOADER_PM    2 // Slot 2, written by loader.asm
+#define BOOT_PHASE_LZ4_START    3 // Slot 3, written by lz4_stub.asm
+#define BOOT_PHASE_LZ4_END      4 // Slot 4, written by lz4_stub.asm
+#define BOOT_PHASE_KERNEL_ENTRY 5
+#define BOOT_PHASE_MEM          6
+#define BOOT_PHASE_PAGING       7
+#define BOOT_PHASE_IDT          8
+#define BOOT_PHASE_PIT          9
+#define BOOT_PHASE_KEYB         10
+#define BOOT_PHASE_SMP          11
+#define BOOT_PHASE_IOAPIC       12
+#define BOOT_PHASE_FRAME_STORE  13
+#define BOOT_PHASE_FIRST_FRAME  14
+#define BOOT_PHASES 15
+
+static uint64_t boot_tsc[BOOT_PHASES];
+
+static const char* const boot_phase_names[BOOT_PHASES] = {
+    "bios", "disk_read", "loader", "stub_copy", "lz4", "kernel_entry",
+    "mem_init", "paging_init", "idt_init", "pit_init", "keyb_init",
+    "smp_init", "ioapic_init", "frame_store", "first_frame"
+};
+
+// Record the end of a phase. Only the first call per phase counts.
+void boot_mark(int phase)
+{
+    if (!boot_tsc[phase]) boot_tsc[phase] = rdtsc();
+}
+
+// Take over the checkpoints from the code that ran before the kernel
+void boot_collect_early(int from_loader, int from_stub)
+{
+    volatile uint64_t* slots = (volatile uint64_t*)BOOT_TSC_SLOTS;
+
+    if (from_loader) {
+        boot_tsc[BOOT_PHASE_LOADER_START] = slots[BOOT_PHASE_LOADER_START];
+        boot_tsc[BOOT_PHASE_LOADER_READ] = slots[BOOT_PHASE_LOADER_READ];
+        boot_tsc[BOOT_PHASE_LOADER_PM] = slots[BOOT_PHASE_LOADER_PM];
+    }
+
+    if (from_stub) {
+        boot_tsc[BOOT_PHASE_LZ4_START] = slots[BOOT_PHASE_LZ4_START];
+        boot_tsc[BOOT_PHASE_LZ4_END] = slots[BOOT_PHASE_LZ4_END];
+    }
+}
+
+// TSC rate in kHz, calibrated against the PIT ticks counted since pit_init
+static uint32_t tsc_khz()
+{
+    uint64_t cycles = rdtsc() - boot_tsc[BOOT_PHASE_PIT];
+    uint32_t ticks = (uint32_t)ticks_count;
 
-    int state = STATE_DESCEND;
-    int flash_lines_count = 0;
-    int lines = 0;
-    int level = 0;
-    int score = 0;
-    int lines_removed;
-    int fall_delay = INITIAL_FALL_DELAY;
+    if (!ticks || !pit_hz || !boot_tsc[BOOT_PHASE_PIT]) return 0;
 
-    int grid[GRID_SIZE_X][GRID_SIZE_Y];
-    int next_grid[NEXT_GRID_SIZE_X][NEXT_GRID_SIZE_Y];
+    div64_32(&cycles, ticks);
+    cycles *= pit_hz;
+    div64_32(&cycles, 1000);
 
-    int tetrominoe[4][2];
-    int next_tetrominoe[4][2];
-    int current;
-    int next = -1;
-    int remove_lines[4] = {-1, -1, -1, -1};
+    return (uint32_t)cycles;
+}
+
+static uint32_t cycles_to_us(uint64_t cycles, uint32_t khz)
+{
+    if (!khz) return 0;
+
+    cycles *= 1000;
+    div64_32(&cycles, khz);
 
-    uint64_t last_move;
-    uint64_t now;
-    uint64_t timediff;
+    return (uint32_t)cycles;
+}
 
-    short block_colours[PIECE_TYPES];
-    char numbers[10] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
+// Show the timeline to the right of the playfield, and log it over serial
+// and debugcon the first time round. "boot total_us=" ends the report.
+void boot_report()
+{
+    static int logged = 0;
+    uint32_t khz = tsc_khz();
+    uint64_t prev = 0;
+    uint64_t cycles;
+    int row = 2;
 
-    // Light gray
-    block_colours[0] = 0x0700;
+    print_string("BOOT TIMELINE", 0x0F00, 0, 50);
+    print_string("phase              us", 0x0700, 1, 50);
 
-    // Red
-    block_colours[1] = 0x0400;
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        if (!boot_tsc[i]) continue;
 
-    // Green
-    block_colours[2] = 0x0200;
+        cycles = boot_tsc[i] - prev;
+        prev = boot_tsc[i];
 
-    // Blue
-    block_colours[3] = 0x0100;
+        print_string((char*)boot_phase_names[i], 0x0700, row, 50);
+        set_numbers_display(63, row, game.numbers, cycles_to_us(cycles, khz));
+        row++;
 
-    // Magenta
-    block_colours[4] = 0x0500;
+        if (!logged) {
+            serial_printf("boot phase=%s cycles=%llu us=%u\n", boot_phase_names[i], cycles, cycles_to_us(cycles, khz));
+        }
+    }
 
-    // Yellow
-    block_colours[5] = 0x0E00;
+    print_string("total", 0x0F00, row, 50);
+    set_numbers_display(63, row, game.numbers, cycles_to_us(prev, khz));
 
-    // Cyan
-    block_colours[6] = 0x0300;
+    if (!logged) {
+        serial_printf("boot total_us=%u tsc_khz=%u\n", cycles_to_us(prev, khz), khz);
+        logged = 1;
+    }
+}
 
+void draw_static_screen()
+{
     for (int i = 0; i < GRID_SIZE_Y; i++) {
         next_frame[(i*80)+GRID_SIZE_X+1] = 0x0F00 | '#';
     }
@@ -771,23 +2618,11 @@ void tetris()
     next_frame[(9*80)+GRID_SIZE_X+10] = 0x0F00 | 'E';
     next_frame[(9*80)+GRID_SIZE_X+11] = 0x0F00 | ':';
 
-    set_numbers_display(GRID_SIZE_X+13, 7, numbers, lines);
-    set_numbers_display(GRID_SIZE_X+13, 9, numbers, score);
-    set_numbers_display(GRID_SIZE_X+13, 8, numbers, level);
-
-    // Clear the grid
-    for (int x = 0; x < GRID_SIZE_X; x++) {
-        for (int y = 0; y < GRID_SIZE_Y; y++) {
-            grid[x][y] = 0;
-        }
-    }
+    print_string("CPU%:", 0x0800, 10, GRID_SIZE_X+6);
 
-    // Clear the next grid
-    for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
-        for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
-            next_grid[x][y] = 0;
-        }
-    }
+    set_numbers_display(GRID_SIZE_X+13, 7, game.numbers, game.lines);
+    set_numbers_display(GRID_SIZE_X+13, 9, game.numbers, game.score);
+    set_numbers_display(GRID_SIZE_X+13, 8, game.numbers, game.level);
 
     print_string("CONTROLS", 0x0F00, 15, GRID_SIZE_X+6);
     print_string("a - Left", 0x0F00, 16, GRID_SIZE_X+6);
@@ -797,193 +2632,825 @@ void tetris()
     print_string("p - Pause", 0x0F00, 20, GRID_SIZE_X+6);
     print_string("r - Restart", 0x0F00, 21, GRID_SIZE_X+6);
     print_string("q - Halt CPU", 0x0F00, 22, GRID_SIZE_X+6);
+}
 
-    current = rand() % 7;
+// Input task: turn each queued scancode into key state, one at a time, and
+// let the logic task see every change before the next scancode is applied
+void input_task()
+{
+    for (;;) {
+        task_wait(EVENT_KEYB);
+
+        while (read_keyb()) {
+            switch (keyb_char) {
+                case 'a':
+                    game.left = keyb_pressed ? 1 : 0;
+                    break;
+                case 'd':
+                    game.right = keyb_pressed ? 1 : 0;
+                    break;
+                case 'w':
+                    game.up = keyb_pressed ? 1 : 0;
+                    break;
+                case 's':
+                    game.down = keyb_pressed ? 1 : 0;
+                    break;
+                case 'q':
+                    game.quit = keyb_pressed ? 1 : 0;
+                    break;
+                case 'p':
+                    game.pause = keyb_pressed ? 1 : 0;
+                    break;
+                case 'r':
+                    if (keyb_pressed) {
+                        game.restart = 1;
+                        sched_stop();
+                        task_yield();
+                    }
+            }
 
-    create_tetrominoe(tetrominoe, grid, block_colours, current);
+            task_signal_all(EVENT_INPUT);
+            task_yield();
+        }
+    }
+}
 
-    // Main loop
-    while (quit == 0) {
-        read_keyb();
+// Logic task: one game step per tick or input change
+void logic_task()
+{
+    for (;;) {
+        game_step(&game);
+        idle_acct_state = game.state;
+        task_signal_all(EVENT_RENDER);
+        task_wait(EVENT_TICK | EVENT_INPUT);
+    }
+}
 
-        switch (keyb_char) {
-            case 'a':
-                left = keyb_pressed ? 1 : 0;
-                break;
-            case 'd':
-                right = keyb_pressed ? 1 : 0;
-                break;
-            case 'w':
-                up = keyb_pressed ? 1 : 0;
-                break;
-            case 's':
-                down = keyb_pressed ? 1 : 0;
-                break;
-            case 'q':
-                quit = keyb_pressed ? 1 : 0;
-                break;
-            case 'p':
-                pause = keyb_pressed ? 1 : 0;
-                break;
-            case 'r':
-                if (keyb_pressed) {
-                    return;
-                }
+// Render task: compose the grids into next_frame and present it
+void render_task()
+{
+    for (;;) {
+        task_wait(EVENT_RENDER);
+
+        engine_render(&game, next_frame);
+
+        draw_next_frame();
+        boot_mark(BOOT_PHASE_FIRST_FRAME);
+
+        if (game.quit) {
+            sched_stop();
+            task_yield();
         }
+    }
+}
+
+// Deferred task: runs the IRQ bottom halves. It shares the input task's
+// priority, so a key is never stuck behind rendering or a bot burst; work
+// queued with defer_work() must be short.
+void deferred_task()
+{
+    for (;;) {
+        run_deferred_work();
+        task_wait(EVENT_DEFERRED);
+    }
+}
+
+static const char* const state_names[ACCT_STATES] = {
+    "create", "descend", "flash", "remove", "gameover", "paused", "", ""
+};
+
+// Print the idle accounting counters over serial, one line per game state
+// and per CPU
+void idle_report_serial()
+{
+    uint64_t busy;
+    uint64_t idle;
+    uint64_t now = rdtsc();
 
-        if (next == -1) {
-            next = rand() % 7;
-            create_next_tetrominoe(next_tetrominoe, next_grid, block_colours, next);
+    for (int i = 0; i < ACCT_STATES; i++) {
+        busy = idle_acct[i].busy_cycles;
+        idle = idle_acct[i].idle_cycles;
+
+        if (busy + idle == 0) continue;
+
+        serial_printf("idle cpu=0 state=%s util=%u%% busy_cycles=%llu idle_cycles=%llu halts=%u\n",
+            state_names[i], percent64(busy, busy + idle), busy, idle, idle_acct[i].halts);
+    }
+
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (!cpus[i].online) continue;
+
+        idle = cpus[i].idle_cycles;
+        busy = now - cpus[i].online_tsc - idle;
+
+        serial_printf("idle cpu=%d util=%u%% busy_cycles=%llu idle_cycles=%llu\n",
+            i, percent64(busy, busy + idle), busy, idle);
+    }
+}
+
+// Stats task: once a second put the BSP's utilisation over the last second
+// on the overlay, and every five seconds dump all counters over serial
+void stats_task()
+{
+    uint64_t next_tick = ticks_count;
+    uint64_t last_busy = 0;
+    uint64_t last_idle = 0;
+    uint64_t busy;
+    uint64_t idle;
+    int seconds = 0;
+
+    for (;;) {
+        next_tick += 100;
+        task_sleep_until(next_tick);
+
+        stack_check();
+
+        // A second in, the TSC calibration is good enough to show
+        if (seconds == 0) {
+            boot_report();
         }
 
-        if (!left && !right && !up && !down && !pause) {
-            key_pressed = 0;
+        busy = 0;
+        idle = 0;
+        for (int i = 0; i < ACCT_STATES; i++) {
+            busy += idle_acct[i].busy_cycles;
+            idle += idle_acct[i].idle_cycles;
         }
 
-        if (!down) {
-            down_pressed = 0;
+        set_numbers_display(GRID_SIZE_X+13, 10, game.numbers,
+            percent64(busy - last_busy, (busy - last_busy) + (idle - last_idle)));
+        last_busy = busy;
+        last_idle = idle;
+
+        if (++seconds % 5 == 0) {
+            idle_report_serial();
+            irq_report_serial();
+            mem_report_serial();
+            arena_report_serial();
+            stack_report_serial();
         }
+    }
+}
 
-        if (state == STATE_DESCEND && !key_pressed && (left || right || up || down || pause)) {
-            if (left) { move_tetrominoe(tetrominoe, grid, MOVE_LEFT); }
-            if (right) { move_tetrominoe(tetrominoe, grid, MOVE_RIGHT); }
-            if (down) { down_pressed = 1; }
-            if (up) { rotate_tetrominoe(tetrominoe, grid, current); }
-            if (pause) { state = STATE_PAUSED; }
+// Attract mode
+// After a while without keys, or a while after game over, the game restarts
+// with the bot playing. It goes through the keyboard path like a player
+// would: keyb_inject() queues the scancodes, so input_task and game_step are
+// exercised exactly as by hand, which makes a long demo a soak test too. Any
+// key hands the game back, except f, which toggles fast-forward.
+#define ATTRACT_IDLE_TICKS 3000     // No keys for 30 s
+#define ATTRACT_GAME_OVER_TICKS 500 // Game over on screen for 5 s
+#define ATTRACT_RESTART_TICKS 300   // Between demo games
+#define ATTRACT_MOVE_TICKS 4        // Between bot inputs at normal speed
+#define ATTRACT_FAST_SPEED 8        // Game clock multiplier when fast
+#define ATTRACT_REPORT_SECONDS 10
+#define ATTRACT_LOOKAHEAD_US 5000   // Per piece, so a round ends within a tick
+
+#define SCANCODE_A 0x1E
+#define SCANCODE_D 0x20
+#define SCANCODE_S 0x1F
+#define SCANCODE_W 0x11
+#define SCANCODE_RELEASE 0x80
+
+static int attract_active = 0;
+static uint32_t attract_games = 0;
+static uint32_t attract_pieces = 0;
+static uint32_t attract_lines = 0;
+static uint32_t attract_deep = 0; // Pieces placed by the lookahead
+static volatile uint32_t attract_deep_aps = 0; // Jobs that scored a candidate, over all rounds
+
+// Two-piece lookahead on the APs. The attract task starts a round for each
+// piece and posts one job to each AP's mailbox; each job takes candidates
+// until none are left or the deadline passes. The attract task only polls:
+// it holds the bot's next input while the round runs and then takes the
+// best candidate scored, so the BSP's tasks never wait on the APs.
+static volatile uint64_t attract_round_deadline;
+static uint32_t attract_round_piece = 0; // game.pieces + 1 of the last round
+static int attract_round_jobs = 0;       // Submitted and not yet collected
+static int attract_round_live = 0;
+
+// Runs on an AP
+static void attract_lookahead_job(void* arg)
+{
+    struct lookahead* round = arg;
+    struct lookahead_scratch* scratch = attract_scratch[this_cpu()->id];
+    int candidate;
+    int scored = 0;
+
+    while (rdtsc() < attract_round_deadline && (candidate = lookahead_claim(round)) >= 0) {
+        lookahead_score(round, candidate, scratch);
+        scored = 1;
+    }
 
-            key_pressed = 1;
-        } else if (state == STATE_PAUSED && !key_pressed && pause) {
-            print_string("      ", 0x0200, 11, GRID_SIZE_X+6);
-            state = STATE_DESCEND;
+    if (scored) __atomic_fetch_add(&attract_deep_aps, 1, __ATOMIC_RELAXED);
+}
 
-            key_pressed = 1;
-        }
+// Post a lookahead job to every AP. Returns the number posted.
+static int attract_post_round(struct job* job)
+{
+    int jobs = 0;
 
-        now = ticks_count;
-        timediff = now - last_move;
+    for (int i = 1; i < MAX_CPUS; i++) {
+        jobs += smp_post(i, job);
+    }
 
-        switch (state) {
-            case STATE_CREATE_PIECE:
-                if (create_tetrominoe(tetrominoe, grid, block_colours, next)) {
-                    current = next;
-                    next = -1;
-                    state = STATE_DESCEND;
-                    down_pressed = 0;
-                } else {
-                    state = STATE_GAME_OVER;
-                }
+    return jobs;
+}
 
-                break;
+// Carve a lookahead scratch for each CPU that came up out of game_arena,
+// after it is reset for a new game. Leaves the pointers 0 if it is full.
+static void attract_alloc()
+{
+    pool_init(&attract_scratch_pool, "lookahead", &game_arena, sizeof(struct lookahead_scratch), cpu_count);
 
-            case STATE_DESCEND:
-                if (timediff > (down_pressed ? DROP_FALL_DELAY : fall_delay)) {
-                    if (!move_tetrominoe(tetrominoe, grid, MOVE_DOWN)) {
-                        if (get_remove_lines(grid, remove_lines) > 0) {
-                            state = STATE_ROW_FLASH;
-                        } else {
-                            state = STATE_CREATE_PIECE;
-                        }
-                    }
+    for (int i = 0; i < MAX_CPUS; i++) {
+        attract_scratch[i] = i == 0 || cpus[i].online ? pool_alloc(&attract_scratch_pool) : 0;
+        if (attract_scratch[i]) memset(&attract_scratch[i]->tt_stats, 0, sizeof(struct tt_stats));
+    }
+}
 
-                    last_move = now;
-                }
+// The APs' transposition table counters for this game, summed
+static void attract_tt_stats(struct tt_stats* sum)
+{
+    sum->probes = sum->hits = sum->stores = sum->evictions = 0;
 
-                break;
+    for (int i = 1; i < MAX_CPUS; i++) {
+        if (!attract_scratch[i]) continue;
 
-            case STATE_ROW_FLASH:
-                if (timediff > 10) {
-                    if (flash_lines_count < 4) {
-                        cycle_remove_lines(grid, remove_lines);
-                        flash_lines_count++;
-                    } else {
-                        flash_lines_count = 0;
-                        state = STATE_ROW_REMOVE;
-                    }
+        sum->probes += attract_scratch[i]->tt_stats.probes;
+        sum->hits += attract_scratch[i]->tt_stats.hits;
+        sum->stores += attract_scratch[i]->tt_stats.stores;
+        sum->evictions += attract_scratch[i]->tt_stats.evictions;
+    }
+}
 
-                    last_move = now;
-                }
+// Start, poll or finish the round for the piece in play. Returns 1 while
+// the bot should hold off for it.
+static int attract_lookahead(uint64_t budget)
+{
+    struct job job;
 
-                break;
+    while (smp_collect(&job)) {
+        if (job.fn == attract_lookahead_job) attract_round_jobs--;
+    }
 
-            case STATE_ROW_REMOVE:
-                lines_removed = do_remove_lines(grid, remove_lines);
-                lines += lines_removed;
-                if (lines > 9999) { lines = 9999; }
-                set_numbers_display(GRID_SIZE_X+13, 7, numbers, lines);
+    if (attract_round_live) {
+        if (attract_round.scored < (uint32_t)attract_round.count && rdtsc() < attract_round_deadline) return 1;
 
-                switch (lines_removed) {
-                    case 1:
-                        score += 40 * (level + 1);
-                        break;
+        attract_deep += bot_lookahead_finish(&attract_bot, &game, &attract_round);
+        attract_round_live = 0;
 
-                    case 2:
-                        score += 100 * (level + 1);
-                        break;
+        return 0;
+    }
 
-                    case 3:
-                        score += 300 * (level + 1);
-                        break;
+    // One round per piece, and none while the last one's jobs are still out
+    if (cpu_count == 1 || !attract_scratch[0] || attract_round_piece == game.pieces + 1 || attract_round_jobs) return 0;
 
-                    case 4:
-                        score += 1200 * (level + 1);
-                        break;
-                }
+    // The next piece is picked on the step after a spawn
+    if (game.next < 0) return 1;
+
+    attract_round_piece = game.pieces + 1;
+    if (!bot_lookahead_start(&attract_bot, &game, &attract_round)) return 0;
+
+    attract_round_deadline = rdtsc() + budget;
+    job.fn = attract_lookahead_job;
+    job.arg = &attract_round;
+
+    attract_round_jobs = attract_post_round(&job);
+    attract_round_live = attract_round_jobs > 0;
+
+    return attract_round_live;
+}
+
+// The bot's keys, as scancodes through the keyboard path, see bot_play_turn()
+static void attract_set_key(void* ctx, char key, int pressed)
+{
+    uint8_t scancode = SCANCODE_S;
+
+    (void)ctx;
+
+    if (key == 'L') scancode = SCANCODE_A;
+    if (key == 'R') scancode = SCANCODE_D;
+    if (key == 'U') scancode = SCANCODE_W;
+
+    keyb_inject(pressed ? scancode : scancode | SCANCODE_RELEASE);
+}
+
+// Let input_task and game_step play each move of a burst
+static void attract_pause(void* ctx)
+{
+    (void)ctx;
+    task_yield();
+}
 
-                if (score > 99999999) { score = 99999999; }
+// Start a new game, with the bot playing or not
+static void attract_restart(int active)
+{
+    attract_active = active;
+    game_speed = 1;
+    game.restart = 1;
+    sched_stop();
+    task_yield();
+}
+
+// Attract task: watches for idle and game over, and plays the demo
+void attract_task()
+{
+    uint32_t seen = keyb_real_count;
+    uint64_t last_key = ticks_count;
+    uint64_t over_since = 0;
+    uint64_t next_move = ticks_count;
+    uint64_t next_second = ticks_count + pit_hz;
+    uint64_t last_nodes = 0;
+    uint64_t budget = (uint64_t)tsc_khz() * ATTRACT_LOOKAHEAD_US;
+    uint32_t last_pieces = 0;
+    struct bot_keys keys = { attract_set_key, attract_pause, 0, 0 };
+    uint32_t pps = 0;
+    uint32_t nodes_per_sec = 0;
+    int seconds = 0;
+
+    div64_32(&budget, 1000);
+
+    // A round left over from the last game is dropped; its jobs are still
+    // collected before the next one starts
+    attract_round_live = 0;
+    attract_round_piece = 0;
+
+    if (attract_active) {
+        bot_init(&attract_bot, 0);
+        attract_bot.tt = &search_tt;
+        print_string("PCS/S:", 0x0800, 23, GRID_SIZE_X+6);
+        print_string("NODE/S:", 0x0800, 24, GRID_SIZE_X+6);
+        print_string("DEMO", 0x0E00, 23, GRID_SIZE_X+22);
+        print_string("f - Fast", 0x0F00, 24, GRID_SIZE_X+22);
+    }
+
+    for (;;) {
+        task_wait(EVENT_TICK | EVENT_KEYB);
 
-                set_numbers_display(GRID_SIZE_X+13, 9, numbers, score);
+        if (keyb_real_count != seen) {
+            seen = keyb_real_count;
+            last_key = ticks_count;
 
-                if (level != 9 && lines >= (level * 10) + 10) {
-                    level++;
-                    fall_delay -= 10;
+            if (attract_active && !(keyb_real_last & SCANCODE_RELEASE)) {
+                char key = scancode_table[keyb_real_last];
 
-                    set_numbers_display(GRID_SIZE_X+13, 8, numbers, level);
+                if (key == 'f') {
+                    game_speed = game_speed == 1 ? ATTRACT_FAST_SPEED : 1;
+                    print_string(game_speed == 1 ? "    " : " x8 ", 0x0E00, 23, GRID_SIZE_X+26);
+                } else if (key != 'q') {
+                    attract_restart(0);
                 }
+            }
+        }
 
-                state = STATE_CREATE_PIECE;
+        if (game.state != STATE_GAME_OVER) {
+            over_since = 0;
+        } else if (!over_since) {
+            over_since = ticks_count;
+
+            if (attract_active) {
+                attract_games++;
+                attract_pieces += game.pieces + 1;
+                attract_lines += game.lines;
+                serial_printf("attract game_over games=%u pieces=%u lines=%u score=%u truncated=%u\n",
+                    attract_games, game.pieces + 1, game.lines, game.score, attract_bot.truncated);
+            }
+        }
 
-                break;
+        if (!attract_active) {
+            if ((game.state != STATE_PAUSED && ticks_count - last_key >= ATTRACT_IDLE_TICKS)
+                    || (over_since && ticks_count - over_since >= ATTRACT_GAME_OVER_TICKS)) {
+                attract_restart(1);
+            }
+
+            continue;
+        }
 
-            case STATE_GAME_OVER:
-                print_string("GAME OVER", 0x0400, 12, GRID_SIZE_X+6);
+        if (over_since) {
+            if (ticks_count - over_since >= ATTRACT_RESTART_TICKS) attract_restart(1);
 
-                break;
+            continue;
+        }
+
+        if (game.state == STATE_DESCEND && ticks_count >= next_move && !attract_lookahead(budget)) {
+            bot_play_turn(&attract_bot, &game, &keys, game_speed);
+            next_move = ticks_count + (game_speed == 1 ? ATTRACT_MOVE_TICKS : 1);
+        }
 
-            case STATE_PAUSED:
-                print_string("PAUSED", 0x0200, 11, GRID_SIZE_X+6);
+        if (ticks_count >= next_second) {
+            next_second += pit_hz;
 
-                break;
+            pps = game.pieces - last_pieces;
+            nodes_per_sec = (uint32_t)(attract_bot.nodes - last_nodes);
+            last_pieces = game.pieces;
+            last_nodes = attract_bot.nodes;
+
+            set_numbers_display(GRID_SIZE_X+13, 23, game.numbers, pps);
+            set_numbers_display(GRID_SIZE_X+13, 24, game.numbers, nodes_per_sec);
+
+            if (++seconds % ATTRACT_REPORT_SECONDS == 0) {
+                struct tt_stats tt;
+
+                attract_tt_stats(&tt);
+                serial_printf("attract tt_probes=%u tt_hits=%u tt_hit_pct=%u tt_stores=%u tt_evictions=%u\n",
+                    tt.probes, tt.hits, percent64(tt.hits, tt.probes), tt.stores, tt.evictions);
+                serial_printf("attract games=%u pieces=%u lines=%u pps=%u nodes_per_sec=%u speed=%u cpus=%d deep=%u deep_aps=%u\n",
+                    attract_games, attract_pieces + game.pieces + 1, attract_lines + game.lines,
+                    pps, nodes_per_sec, game_speed, cpu_count, attract_deep, attract_deep_aps);
+            }
         }
+    }
+}
+
+// Benchmark mode
+// Built with BENCH_MODE=1 (bench.img from build.sh) the kernel runs this
+// suite on the real freestanding code instead of the game, prints one
+// key=value line per benchmark on serial/debugcon and leaves QEMU through
+// the isa-debug-exit device with the status (0 = all ran). See tools/bench.sh.
+#ifndef BENCH_MODE
+#define BENCH_MODE 0
+#endif
+
+#define DEBUG_EXIT_PORT 0xF4 // -device isa-debug-exit,iobase=0xf4,iosize=0x04
+#define BENCH_OPS 20000
+#define BENCH_IRQ_OPS 2000
+#define BENCH_SIM_GAMES 2000
+
+static struct game bench_game;
+static int bench_grid[GRID_SIZE_X][GRID_SIZE_Y];
+static int bench_full_grid[GRID_SIZE_X][GRID_SIZE_Y];
+static struct placement_search bench_search;
+static struct placement bench_placements[PLACEMENT_MAX];
+static struct board bench_board;
+static volatile int bench_sink;
+static uint32_t bench_khz;
+static int bench_failures;
+
+static void bench_result(const char* name, int param, uint32_t ops, uint64_t cycles)
+{
+    uint64_t per_op = cycles;
+    uint64_t ns_x100 = cycles * 100000;
+
+    div64_32(&per_op, ops);
+    div64_32(&ns_x100, bench_khz ? bench_khz : 1);
+    div64_32(&ns_x100, ops);
+
+    serial_printf("bench=%s param=%d ops=%u cycles_per_op=%llu ns_per_op=%u.%c%c\n",
+        name, param, ops, per_op, (uint32_t)ns_x100 / 100,
+        '0' + (uint32_t)ns_x100 / 10 % 10, '0' + (uint32_t)ns_x100 % 10);
+}
+
+static void bench_copy_grid(int dst[GRID_SIZE_X][GRID_SIZE_Y], int src[GRID_SIZE_X][GRID_SIZE_Y])
+{
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        for (int y = 0; y < GRID_SIZE_Y; y++) {
+            dst[x][y] = src[x][y];
+        }
+    }
+}
+
+// Half-full board with a hole in every row, a falling piece at the top, and
+// a copy with two full rows for the line benchmarks
+static void bench_fixture()
+{
+    struct game* game = &bench_game;
 
-        // Redraw screen
+    game_init(game, 1);
+
+    for (int y = GRID_SIZE_Y / 2; y < GRID_SIZE_Y; y++) {
         for (int x = 0; x < GRID_SIZE_X; x++) {
-            for (int y = 0; y < GRID_SIZE_Y; y++) {
-                if (grid[x][y] == 0) {
-                    next_frame[y*80+x+1] = 0x0700 | ' ';
-                } else if ((grid[x][y] & 0x00FF) == ' ') {
-                    next_frame[y*80+x+1] = grid[x][y] | ' ';
-                } else {
-                    next_frame[y*80+x+1] = grid[x][y] | '#';
-                }
+            if (engine_rand(game) % 5) game->grid[x][y] = game->block_colours[1];
+        }
+        game->grid[engine_rand(game) % GRID_SIZE_X][y] = 0;
+    }
+
+    bench_copy_grid(bench_full_grid, game->grid);
+    for (int x = 0; x < GRID_SIZE_X; x++) {
+        bench_full_grid[x][GRID_SIZE_Y - 1] = game->block_colours[0];
+        bench_full_grid[x][GRID_SIZE_Y - 3] = game->block_colours[0];
+    }
+
+    game->current = PIECE_T;
+    create_tetrominoe(game->tetrominoe, game->grid, game->block_colours, game->current);
+    move_tetrominoe(game->tetrominoe, game->grid, MOVE_DOWN);
+}
+
+static void bench_engine()
+{
+    struct game* game = &bench_game;
+    int start_piece[4][2];
+    int remove_lines[4];
+    uint64_t start;
+    uint64_t cycles;
+    int sum = 0;
+
+    bench_fixture();
+    copy_tetrominoe(game->tetrominoe, start_piece);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sum += check_tetrominoe_collision(game->tetrominoe, game->grid);
+    }
+    bench_result("collision", 50, BENCH_OPS, rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS; i += 2) {
+        sum += move_tetrominoe(game->tetrominoe, game->grid, MOVE_LEFT);
+        sum += move_tetrominoe(game->tetrominoe, game->grid, MOVE_RIGHT);
+    }
+    bench_result("move", 50, BENCH_OPS, rdtsc() - start);
+
+    // A full turn brings the piece back to its shape but not its place
+    cycles = 0;
+    for (int i = 0; i < BENCH_OPS; i += 4) {
+        start = rdtsc();
+        for (int turn = 0; turn < 4; turn++) {
+            rotate_tetrominoe(game->tetrominoe, game->grid, game->current);
+        }
+        cycles += rdtsc() - start;
+
+        for (int j = 0; j < 4; j++) game->grid[game->tetrominoe[j][0]][game->tetrominoe[j][1]] = 0;
+        copy_tetrominoe(start_piece, game->tetrominoe);
+        for (int j = 0; j < 4; j++) game->grid[game->tetrominoe[j][0]][game->tetrominoe[j][1]] = game->block_colours[1];
+    }
+    bench_result("rotate", 50, BENCH_OPS, cycles);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sum += get_remove_lines(bench_full_grid, remove_lines);
+    }
+    bench_result("line_detect", 50, BENCH_OPS, rdtsc() - start);
+
+    cycles = 0;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        bench_copy_grid(bench_grid, bench_full_grid);
+        remove_lines[0] = remove_lines[1] = remove_lines[2] = remove_lines[3] = -1;
+        get_remove_lines(bench_grid, remove_lines);
+
+        start = rdtsc();
+        sum += do_remove_lines(bench_grid, remove_lines);
+        cycles += rdtsc() - start;
+    }
+    bench_result("line_remove", 50, BENCH_OPS, cycles);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        engine_render(game, next_frame);
+    }
+    bench_result("render", 50, BENCH_OPS, rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS / 100; i++) {
+        sum += find_placements(&bench_search, game->tetrominoe, game->grid, game->current, bench_placements, PLACEMENT_MAX);
+    }
+    bench_result("placements", 50, BENCH_OPS / 100, rdtsc() - start);
+
+    board_from_grid(&bench_board, game->grid, game->tetrominoe);
+    start = rdtsc();
+    for (int i = 0; i < BENCH_OPS; i++) {
+        sum += board_evaluate(&bench_board, 0, &eval_default_weights);
+    }
+    bench_result("evaluate", 50, BENCH_OPS, rdtsc() - start);
+
+    bench_sink = sum;
+}
+
+// Two-piece lookahead rounds on the bench board: on the BSP alone, then
+// with every AP taking candidates while the BSP waits for the last one
+static void bench_lookahead()
+{
+    struct game* game = &bench_game;
+    struct job job = { attract_lookahead_job, &attract_round };
+    int rounds = BENCH_OPS / 1000;
+    int candidate;
+    int jobs;
+    uint64_t start;
+
+    attract_alloc();
+    if (!attract_scratch[0]) return;
+
+    bench_fixture();
+    game->next = PIECE_LINE;
+    bot_init(&attract_bot, 0);
+
+    start = rdtsc();
+    for (int i = 0; i < rounds; i++) {
+        bot_lookahead_start(&attract_bot, game, &attract_round);
+        while ((candidate = lookahead_claim(&attract_round)) >= 0) {
+            lookahead_score(&attract_round, candidate, attract_scratch[0]);
+        }
+    }
+    bench_result("lookahead", 1, rounds, rdtsc() - start);
+
+    if (cpu_count == 1) return;
+
+    attract_round_deadline = ~0ULL;
+    attract_deep_aps = 0;
+    start = rdtsc();
+    for (int i = 0; i < rounds; i++) {
+        bot_lookahead_start(&attract_bot, game, &attract_round);
+
+        jobs = attract_post_round(&job);
+
+        while (jobs) {
+            if (smp_collect(&job)) {
+                jobs--;
+            } else {
+                __asm__ __volatile__ ("pause");
             }
         }
+    }
+    bench_result("lookahead", cpu_count - 1, rounds, rdtsc() - start);
 
-        for (int x = 0; x < NEXT_GRID_SIZE_X; x++) {
-            for (int y = 0; y < NEXT_GRID_SIZE_Y; y++) {
-                if (next_grid[x][y] == 0) {
-                    next_frame[(y+3)*80+x+GRID_SIZE_X+6] = 0x0700 | ' ';
-                } else {
-                    next_frame[(y+3)*80+x+GRID_SIZE_X+6] = next_grid[x][y] | '#';
-                }
+    // How many APs a round really kept busy
+    serial_printf("bench=lookahead_aps param=%d rounds=%d ap_jobs=%u\n",
+        cpu_count - 1, rounds, attract_deep_aps);
+
+    bench_sink = attract_round.best;
+}
+
+// Present with pct% of the cells changed since the last frame
+static void bench_present()
+{
+    static const int ratios[] = { 0, 10, 50, 100 };
+    uint64_t start;
+    uint64_t cycles;
+    int ops = 200;
+
+    for (uint32_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+        cycles = 0;
+
+        for (int i = 0; i < ops; i++) {
+            for (int cell = 0; cell < 2000; cell++) {
+                if (cell % 100 < ratios[r]) next_frame[cell] ^= 0x0100;
+            }
+
+            start = rdtsc();
+            draw_next_frame();
+            cycles += rdtsc() - start;
+        }
+
+        bench_result("present", ratios[r], ops, cycles);
+    }
+}
+
+// Self-IPI to the wake vector and back: LAPIC delivery, the stub, the
+// handler and EOI
+static void bench_irq()
+{
+    uint64_t start;
+    uint32_t seen;
+
+    if (!lapic) {
+        serial_printf("bench=irq_roundtrip skipped=no_lapic\n");
+        return;
+    }
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_IRQ_OPS; i++) {
+        uint32_t spins = 0;
+
+        seen = ipi_wake_count;
+        lapic_send_ipi(cpus[0].apic_id, ICR_ASSERT | IPI_WAKE_VECTOR);
+
+        while (ipi_wake_count == seen) {
+            if (++spins == 10000000) {
+                serial_printf("bench=irq_roundtrip error=timeout\n");
+                bench_failures++;
+                return;
             }
         }
+    }
+    bench_result("irq_roundtrip", 0, BENCH_IRQ_OPS, rdtsc() - start);
+}
 
-        draw_next_frame();
+// Port I/O: a PIC register, the POST port and the UART status register
+static void bench_port_io()
+{
+    uint64_t start;
+    int ops = 2000;
+    int sum = 0;
+
+    start = rdtsc();
+    for (int i = 0; i < ops; i++) sum += inb(PIC1_DATA);
+    bench_result("inb_pic", PIC1_DATA, ops, rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < ops; i++) outb(0x80, 0);
+    bench_result("outb_post", 0x80, ops, rdtsc() - start);
+
+    start = rdtsc();
+    for (int i = 0; i < ops; i++) sum += inb(COM1 + 5);
+    bench_result("inb_uart", COM1 + 5, ops, rdtsc() - start);
+
+    bench_sink = sum;
+}
+
+// Headless games with random placements, as host/engine_sim does
+static void bench_sim()
+{
+    struct sim_stats stats;
+    uint32_t rng = 1;
+    uint64_t start;
+    uint64_t cycles;
+    uint64_t us;
+    uint64_t games_per_sec;
+    uint64_t pieces_per_sec;
+    uint64_t mean;
+
+    sim_stats_init(&stats);
+
+    start = rdtsc();
+    for (int i = 0; i < BENCH_SIM_GAMES; i++) {
+        sim_game(&bench_game, i + 1, 0, sim_policy_random, &rng, &stats);
+    }
+    cycles = rdtsc() - start;
+
+    bench_result("sim_piece", 0, (uint32_t)stats.pieces, cycles);
+
+    us = cycles * 1000;
+    div64_32(&us, bench_khz ? bench_khz : 1);
+    if (!us) us = 1;
+
+    games_per_sec = (uint64_t)stats.games * 1000000;
+    div64_32(&games_per_sec, (uint32_t)us);
+    pieces_per_sec = stats.pieces * 1000000;
+    div64_32(&pieces_per_sec, (uint32_t)us);
+    mean = stats.score_total;
+    div64_32(&mean, stats.games);
+
+    serial_printf("sim games=%u pieces=%llu lines=%llu us=%llu games_per_sec=%llu pieces_per_sec=%llu\n",
+        stats.games, stats.pieces, stats.lines, us, games_per_sec, pieces_per_sec);
+    serial_printf("sim score_min=%d score_mean=%llu score_max=%d\n",
+        stats.score_min, mean, stats.score_max);
+
+    for (int i = 0; i < SIM_SCORE_BUCKETS; i++) {
+        if (stats.score_hist[i]) {
+            serial_printf("sim score_bits=%d games=%u\n", i, stats.score_hist[i]);
+        }
+    }
+}
 
+void bench_run()
+{
+    // Give the TSC calibration a quarter second of PIT ticks
+    wait_ticks(25);
+    bench_khz = tsc_khz();
+    serial_printf("bench start tsc_khz=%u cpus=%d\n", bench_khz, cpu_count);
+
+    clear_screen();
+    init_frame_store();
+
+    bench_engine();
+    bench_sim();
+    bench_lookahead();
+    bench_present();
+    bench_irq();
+    bench_port_io();
+
+    serial_printf("bench done status=%d\n", bench_failures);
+
+    // QEMU exits with (status << 1) | 1; without the device, just stop
+    outb(DEBUG_EXIT_PORT, bench_failures);
+    disable_interrupts();
+
+    for (;;) {
         __asm__ __volatile__("hlt");
     }
+}
+
+void tetris()
+{
+    clear_screen();
+
+    game_init(&game, (uint32_t)rdtsc() ^ get_rtc_register(0x00));
+    draw_static_screen();
+
+    game.current = engine_rand(&game) % 7;
+
+    create_tetrominoe(game.tetrominoe, game.grid, game.block_colours, game.current);
+
+    sched_reset();
+    task_create(logic_task, 3, "logic");
+    task_create(input_task, 2, "input");
+    task_create(render_task, 1, "render");
+    task_create(deferred_task, 2, "deferred");
+    task_create(stats_task, 0, "stats");
+    task_create(attract_task, 1, "attract");
+
+    // Runs until a task asks to restart or quit
+    sched_run();
+
+    if (game.restart) {
+        return;
+    }
 
     print_string("CPU HALTED", 0x0100, 13, GRID_SIZE_X+6);
+    idle_report_serial();
+    mem_report_serial();
+    arena_report_serial();
+    stack_report_serial();
 
     disable_interrupts();
 
@@ -994,12 +3461,62 @@ void tetris()
 
 void main()
 {
+    uint32_t esp;
+
+    boot_mark(BOOT_PHASE_KERNEL_ENTRY);
+
+    // Paint the boot stack up to a little below where we are now
+    __asm__ __volatile__ ("movl %%esp, %0" : "=r"(esp));
+    stack_paint((uint8_t*)(BOOT_STACK_TOP - BOOT_STACK_SIZE), (uint8_t*)(esp - 256));
+
+    serial_init();
+
+    if (boot_magic == BOOT_MAGIC_MULTIBOOT) {
+        serial_printf("boot protocol=multiboot info=0x%x\n", boot_info);
+    } else if (boot_magic == BOOT_MAGIC_PVH) {
+        serial_printf("boot protocol=pvh info=0x%x\n", boot_info);
+    } else {
+        serial_printf("boot protocol=floppy\n");
+    }
+
+    boot_collect_early(boot_magic != BOOT_MAGIC_MULTIBOOT && boot_magic != BOOT_MAGIC_PVH,
+        boot_lz4->magic == BOOT_LZ4_MAGIC);
+
+    if (boot_lz4->magic == BOOT_LZ4_MAGIC) {
+        serial_printf("boot lz4 compressed=%u size=%u cycles=%u\n",
+            boot_lz4->compressed_size, boot_lz4->size, boot_lz4->cycles);
+        boot_lz4->magic = 0;
+    }
+
+    mem_init();
+    arena_init(&game_arena, "game", GAME_ARENA_PAGES);
+    arena_init(&search_arena, "search", SEARCH_ARENA_PAGES);
+    zobrist_init();
+    tt_init(&search_tt, arena_alloc(&search_arena, SEARCH_ARENA_PAGES * PAGE_SIZE, 64), SEARCH_ARENA_PAGES * PAGE_SIZE);
+    mem_report_serial();
+    boot_mark(BOOT_PHASE_MEM);
+    paging_init();
+    boot_mark(BOOT_PHASE_PAGING);
     idt_init();
+    fault_init();
+    boot_mark(BOOT_PHASE_IDT);
     pit_init(100); // 100 Hz tick (10 ms per tick)
+    boot_mark(BOOT_PHASE_PIT);
     keyb_init();
+    boot_mark(BOOT_PHASE_KEYB);
+    smp_init();
+    boot_mark(BOOT_PHASE_SMP);
+    ioapic_init();
+    boot_mark(BOOT_PHASE_IOAPIC);
+    budget_report_serial();
+
+    if (BENCH_MODE) bench_run();
 
     for (;;) {
+        arena_reset(&game_arena);
+        attract_alloc();
         init_frame_store();
+        boot_mark(BOOT_PHASE_FRAME_STORE);
         tetris();
     }
 }
\ No newline at end of file
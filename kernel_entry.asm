@@ -1,15 +1,129 @@
 ; kernel_entry.asm — 32-bit entry stub that calls main()
 ; Assemble: nasm -f elf32 kernel_entry.asm -o kernel_entry.o
+;
+; Three ways in, all in flat 32-bit protected mode:
+;   loader.asm   jumps to _start with EAX = 0x10000
+;   Multiboot    enters _start with EAX = 0x2BADB002, EBX = multiboot info
+;   PVH          enters _start_pvh with EBX = hvm_start_info
+; The magic and info pointer are kept in boot_magic and boot_info (in .data,
+; as .bss is only zeroed afterwards). Direct boots make no promises about the
+; GDT or stack, so set up our own.
 
 bits 32
 global _start
+global _start_pvh
+global boot_magic
+global boot_info
+global enable_sse
 extern main
+extern __kernel_sectors
+extern __bss_start
+extern __bss_end
 
-section .text
+MULTIBOOT_MAGIC equ 0x1BADB002
+MULTIBOOT_FLAGS equ 0x00000003 ; Page-aligned modules, memory info
+PVH_MAGIC       equ 0x336EC578 ; hvm_start_info magic, used as our boot_magic
+XEN_ELFNOTE_PHYS32_ENTRY equ 18
+
+; linker.ld places this section first, at 0x10000
+section .text.entry progbits alloc exec nowrite align=16
 _start:
-    ; At this point: flat 32-bit mode, segments already flat from bootloader
-    ; (If you want your own stack here, you can set ESP again.)
+    jmp short kernel_entry
+
+; Read by loader.asm before it loads the rest of the kernel
+align 4, db 0
+kernel_header:
+    dd 0x4B544D42       ; "BMTK"
+    dd __kernel_sectors ; Size of kernel.bin in sectors, from linker.ld
+
+; Must be in the first 8 KB of kernel.elf
+align 4, db 0
+multiboot_header:
+    dd MULTIBOOT_MAGIC
+    dd MULTIBOOT_FLAGS
+    dd -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)
+
+_start_pvh:
+    mov eax, PVH_MAGIC
+
+kernel_entry:
+    cli
+    mov [boot_magic], eax
+    mov [boot_info], ebx
+
+    lgdt [boot_gdt_descriptor]
+    jmp 0x08:.reload_segments ; far jump to load CS
+
+.reload_segments:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov fs, ax
+    mov gs, ax
+    mov esp, 0x200000
+
+    call enable_sse
+
+    ; Zero .bss, neither the loader nor a direct boot promises to
+    cld
+    xor eax, eax
+    mov edi, __bss_start
+    mov ecx, __bss_end
+    sub ecx, edi
+    shr ecx, 2
+    rep stosd
+
     call main
 .hang:
     hlt
     jmp .hang
+
+; Let C code use the FPU and SSE if the CPU has them: kernels built with an
+; SSE -march may use the XMM registers anywhere. Also called by the APs from
+; ap_trampoline.asm. Clobbers EAX, ECX and EDX.
+enable_sse:
+    push ebx
+    mov eax, 1
+    cpuid
+    pop ebx
+    test edx, 1 << 25 ; SSE
+    jz .done
+    test edx, 1 << 24 ; FXSAVE/FXRSTOR
+    jz .done
+
+    mov eax, cr0
+    and eax, ~(1 << 2) ; EM off: no x87 emulation
+    or eax, 1 << 1     ; MP on
+    mov cr0, eax
+    mov eax, cr4
+    or eax, (1 << 9) | (1 << 10) ; OSFXSR, OSXMMEXCPT
+    mov cr4, eax
+    fninit
+
+.done:
+    ret
+
+; Same flat layout as the loader's GDT
+align 8
+boot_gdt:
+    dq 0x0000000000000000
+    dq 0x00CF9A000000FFFF ; code: base=0, limit=4GB
+    dq 0x00CF92000000FFFF ; data: base=0, limit=4GB
+boot_gdt_end:
+
+boot_gdt_descriptor:
+    dw boot_gdt_end - boot_gdt - 1
+    dd boot_gdt
+
+section .data
+boot_magic dd 0
+boot_info  dd 0
+
+; PVH entry point for QEMU -kernel / -M microvm
+section .note.Xen note alloc noexec nowrite align=4
+    dd 4                        ; Name size
+    dd 4                        ; Descriptor size
+    dd XEN_ELFNOTE_PHYS32_ENTRY ; Type
+    db "Xen", 0
+    dd _start_pvh
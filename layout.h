@@ -0,0 +1,14 @@
+// layout.h — fixed addresses in the kernel's memory map
+// Plain #defines only: build.sh runs this through the C preprocessor to
+// check the image fits below the boot stack guard.
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+// Boot stack, set up by kernel_entry.asm and loader.asm. With paging on, the
+// page below it is left unmapped as a guard, see fault_init() in kernel.c.
+#define BOOT_STACK_TOP  0x200000
+#define BOOT_STACK_SIZE 0x10000
+#define BOOT_STACK_GUARD (BOOT_STACK_TOP - BOOT_STACK_SIZE - 0x1000)
+
+#endif
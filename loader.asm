@@ -1,14 +1,40 @@
 bits 16
 org 0x7c00 ; Start address for boot sector
 
+KERNEL_SEG equ 0x1000 ; Kernel is loaded to 0x1000:0000 (0x10000)
+KERNEL_MAGIC equ 0x4B544D42 ; "BMTK", see kernel_header in kernel_entry.asm
+MAX_KERNEL_SECTORS equ 1024 ; 512 KB, up to 0x90000
+BOOT_TSC equ 0x520 ; Boot timeline slots, see BOOT_TSC_SLOTS in kernel.c
+E820_MAP equ 0x600 ; BIOS memory map, see E820_MAP in kernel.c
+E820_MAX equ 32
+SMAP equ 0x534D4150 ; "SMAP"
+
 ; Set up the stack
+xor ax, ax
+mov ds, ax
+mov es, ax
+mov ss, ax
 mov bp, 0x9000
 mov sp, bp
 
+mov [boot_drive], dl ; BIOS passes the boot drive in DL
+
+mov di, BOOT_TSC ; Loader started
+call record_tsc
+call read_memory_map
 call load_program
+mov di, BOOT_TSC+8 ; Kernel read
+call record_tsc
 call pm_run_program
 jmp $
 
+; Store the time stamp counter at DI
+record_tsc:
+    rdtsc
+    mov [di], eax
+    mov [di+4], edx
+    ret
+
 print_string:
     mov ah, 0x0e ; Teletype output
 
@@ -27,36 +53,151 @@ halt_error:
     call print_string
     jmp $ ; Jump to self - infinite loop
 
+; Store the BIOS E820 memory map at E820_MAP: a dword entry count, then
+; 24-byte entries (base, length, type, extended attributes)
+read_memory_map:
+    mov dword [E820_MAP], 0
+    mov di, E820_MAP+8
+    xor ebx, ebx ; Continuation value, 0 for the first entry
+
+.next_entry:
+    mov dword [di+20], 1 ; Valid, for BIOSes that return only 20 bytes
+    mov eax, 0xE820
+    mov edx, SMAP
+    mov ecx, 24
+    int 0x15
+    jc .done ; Carry also marks the end of the list on some BIOSes
+    cmp eax, SMAP
+    jne .done
+    add di, 24
+    inc word [E820_MAP]
+    cmp word [E820_MAP], E820_MAX
+    jae .done
+    test ebx, ebx
+    jnz .next_entry
+
+.done:
+    ret
+
 load_program:
     mov si, loadingmsg
     call print_string
 
-    xor ax, ax ; Zeros out AX
-    mov ds, ax ; Zeros out DS
-    ; mov es, ax ; Zeros out ES
-    mov ax, 0x1000
+    cld ; Clear direction flag
+
+    ; Drive geometry, keep the 1.44 MB defaults if the BIOS can't tell us
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    xor di, di ; ES:DI = 0:0 works around buggy BIOSes
+    mov es, di
+    int 0x13
+    jc .geometry_done
+    and cx, 0x3F ; Sectors per track
+    mov [sectors_per_track], cx
+    movzx dx, dh ; Highest head number
+    inc dx
+    mov [heads], dx
+
+.geometry_done:
+    mov ax, KERNEL_SEG
     mov es, ax
+    mov fs, ax
     xor bx, bx
-    cld ; Clear direction flag
 
+    ; The rest of track 0 first, that always holds the kernel header
+    mov ax, [sectors_per_track]
+    dec ax
+    call read_sectors
+
+    cmp dword [fs:4], KERNEL_MAGIC
+    jne halt_error
+    mov ax, [fs:8] ; Kernel size in sectors, embedded by linker.ld
+    cmp ax, MAX_KERNEL_SECTORS
+    ja halt_error
+
+    ; Sectors read so far are LBA 1 .. next_lba-1
+    inc ax
+    sub ax, [next_lba]
+    jbe .loaded
+    call read_sectors
+
+.loaded:
+    mov si, okmsg
+    call print_string
+
+    ret
+
+; Read AX sectors starting at [next_lba] to ES:BX, advancing both. Reads as
+; much of a track as possible per BIOS call without crossing a track or a
+; 64 KB boundary, retrying each call a few times with a drive reset.
+read_sectors:
+    mov [sectors_left], ax
+
+.next_chunk:
+    cmp word [sectors_left], 0
+    je .done
+
+    ; LBA -> CHS
+    mov ax, [next_lba]
+    xor dx, dx
+    div word [sectors_per_track] ; AX = track, DX = sector in track
+    mov cl, dl
+    inc cl ; Sectors count from 1
+    mov di, [sectors_per_track]
+    sub di, dx ; Sectors left in this track
+    xor dx, dx
+    div word [heads] ; AX = cylinder, DX = head
+    mov ch, al ; Cylinder bits 0-7
+    shl ah, 6
+    or cl, ah ; Cylinder bits 8-9
+    mov dh, dl ; Head number
+
+    ; Chunk = min(rest of track, sectors left, room before 64 KB boundary)
+    cmp di, [sectors_left]
+    jbe .fits_request
+    mov di, [sectors_left]
+.fits_request:
+    mov ax, bx
+    neg ax
+    shr ax, 9
+    jz .fits_segment ; BX = 0, the whole segment is free
+    cmp di, ax
+    jbe .fits_segment
+    mov di, ax
+.fits_segment:
+
+    mov byte [retries], 3
+.retry:
+    mov ax, di ; AL = number of sectors
     mov ah, 0x02 ; Read sectors
-    ; mov bx, 0x1000 ; In ES
-    mov al, 22 ; Number of sectors to read
     mov dl, [boot_drive] ; Drive number
-    mov ch, 0 ; Cylinder number
-    mov dh, 0 ; Head number
-    mov cl, 2 ; Sector number
+    int 0x13
+    jnc .chunk_done ; Carry flag set if 0x13 errors
 
+    dec byte [retries]
+    jz halt_error
+    xor ah, ah ; Reset drive
     int 0x13
-    jc halt_error ; Jump if carry flag set. Will happen if 0x13 errors
+    jmp .retry
 
-    mov si, okmsg
-    call print_string
+.chunk_done:
+    add [next_lba], di
+    sub [sectors_left], di
+    mov ax, di
+    shl ax, 9
+    add bx, ax
+    jnc .next_chunk
+    mov ax, es ; BX wrapped, move to the next 64 KB
+    add ax, 0x1000
+    mov es, ax
+    jmp .next_chunk
 
+.done:
     ret
 
 pm_run_program:
-    mov si, startmsg
+    mov di, BOOT_TSC+16 ; Switching to protected mode
+    call record_tsc
 
     cli ; Disable interrupts
 
@@ -113,10 +254,14 @@ gdt_descriptor:
     dd gdt_start
 
 boot_drive db 0
+retries db 0
+sectors_per_track dw 18
+heads dw 2
+next_lba dw 1 ; Sector after the boot sector
+sectors_left dw 0
 loadingmsg db "Loading ... ", 0
 okmsg db "OK", 13, 10, 0
 errormsg db "Error", 13, 10, 0
-startmsg db "Entering protected mode and jumping to entry point ...", 13, 10, 0
 
 times 510 - ($-$$) db 0
 dw 0xaa55
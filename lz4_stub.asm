@@ -0,0 +1,131 @@
+; lz4_stub.asm — decompressor placed in front of an LZ4-compressed kernel
+; Assemble: nasm -f bin lz4_stub.asm -o kernel_lz4.bin (needs kernel.lz4)
+;
+; loader.asm loads this image to 0x10000 and jumps to it exactly as it would
+; to kernel.bin. The stub copies itself and the payload out of the way to
+; STUB_BASE, unpacks the payload (lz4 -l legacy frame) to 0x10000 and jumps
+; to the real kernel entry. The decompression time is left at 0x500 and
+; in the boot timeline slots for the kernel to report.
+
+bits 32
+org 0x300000 ; STUB_BASE, where the code below runs after the copy
+
+STUB_BASE equ 0x300000
+KERNEL_BASE equ 0x10000
+LZ4_LEGACY_MAGIC equ 0x184C2102
+
+BOOT_LZ4_INFO equ 0x500 ; dd 'LZ4 ', dd cycles, dd compressed size, dd raw size
+BOOT_TSC equ 0x520 ; Boot timeline slots, see BOOT_TSC_SLOTS in kernel.c
+
+stub_start:
+    jmp short stub_entry
+
+; Same header as kernel_entry.asm, the loader sizes its read from it
+align 4, db 0
+    dd 0x4B544D42                             ; "BMTK"
+    dd (stub_end - stub_start + 511) / 512    ; Sectors in this image
+
+stub_entry:
+    ; Still running at 0x10000: position independent until the jump
+    cld
+    mov esi, KERNEL_BASE
+    mov edi, STUB_BASE
+    mov ecx, (stub_end - stub_start + 3) / 4
+    rep movsd
+    mov eax, relocated
+    jmp eax
+
+relocated:
+    rdtsc
+    mov [tsc_start], eax
+    mov [tsc_start+4], edx
+    mov [BOOT_TSC+24], eax ; Decompression started
+    mov [BOOT_TSC+28], edx
+
+    mov esi, payload
+    mov edi, KERNEL_BASE
+    cmp dword [esi], LZ4_LEGACY_MAGIC
+    jne bad_payload
+    add esi, 4
+
+.next_block:
+    cmp esi, payload_end
+    jae .unpacked
+    mov edx, [esi] ; Compressed block size
+    add esi, 4
+    add edx, esi   ; Block end
+    call lz4_block
+    jmp .next_block
+
+.unpacked:
+    rdtsc
+    mov [BOOT_TSC+32], eax ; Decompression done
+    mov [BOOT_TSC+36], edx
+    sub eax, [tsc_start]
+    mov dword [BOOT_LZ4_INFO], 0x20345A4C ; "LZ4 "
+    mov [BOOT_LZ4_INFO+4], eax
+    mov dword [BOOT_LZ4_INFO+8], payload_end - payload
+    sub edi, KERNEL_BASE
+    mov [BOOT_LZ4_INFO+12], edi
+
+    mov eax, KERNEL_BASE ; Same EAX the loader passes to the raw kernel
+    jmp eax
+
+bad_payload:
+    hlt
+    jmp bad_payload
+
+; Decode one LZ4 block from ESI (ending at EDX) to EDI
+; Clobbers EAX, EBX, ECX, EBP
+lz4_block:
+    xor eax, eax
+    lodsb              ; Token
+    mov ebx, eax
+    shr eax, 4         ; Literal length
+    call lz4_length
+    mov ecx, eax
+    rep movsb
+
+    cmp esi, edx       ; The last sequence is literals only
+    jae .block_done
+
+    movzx ebp, word [esi] ; Match offset
+    add esi, 2
+    mov eax, ebx
+    and eax, 0x0F      ; Match length - 4
+    call lz4_length
+    lea ecx, [eax+4]
+
+    push esi
+    mov esi, edi
+    sub esi, ebp
+    rep movsb          ; Byte copy, the match may overlap its output
+    pop esi
+    jmp lz4_block
+
+.block_done:
+    ret
+
+; EAX holds a 4-bit length; if it is 15 add the extension bytes at ESI
+lz4_length:
+    cmp eax, 15
+    jne .length_done
+
+.length_byte:
+    movzx ecx, byte [esi]
+    inc esi
+    add eax, ecx
+    cmp ecx, 255
+    je .length_byte
+
+.length_done:
+    ret
+
+align 8, db 0
+tsc_start dq 0
+
+payload:
+    incbin "kernel.lz4"
+payload_end:
+
+stub_end:
@@ -0,0 +1,25 @@
+; task_switch.asm -- cooperative context switch (NASM)
+; Exports: switch_context
+
+BITS 32
+GLOBAL switch_context
+
+SECTION .text
+; void switch_context(uint32_t *save_esp, uint32_t load_esp)
+; Push the callee-saved registers, store ESP in *save_esp, then load
+; load_esp and pop the registers saved there. The caller-saved registers
+; are already spilled by the C calling convention.
+switch_context:
+    mov  eax, [esp+4]   ; save_esp
+    mov  edx, [esp+8]   ; load_esp
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov  [eax], esp
+    mov  esp, edx
+    pop  edi
+    pop  esi
+    pop  ebx
+    pop  ebp
+    ret
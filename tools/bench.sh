@@ -0,0 +1,35 @@
+#!/bin/bash
+# Boot bench.img in QEMU, print the benchmark lines it writes to debugcon and
+# exit with its status. QEMU leaves through isa-debug-exit with
+# (status << 1) | 1, so 1 means every benchmark ran.
+#
+#   tools/bench.sh > results.txt
+#   KERNEL=kernel_bench.elf tools/bench.sh   # direct boot instead
+#   QEMU_ARGS="-smp 4 -enable-kvm" tools/bench.sh
+
+QEMU=${QEMU:-qemu-system-i386}
+TIMEOUT=${TIMEOUT:-60}
+LOG=$(mktemp)
+trap 'rm -f "$LOG"' EXIT
+
+if [ -n "$KERNEL" ]; then
+    BOOT="-kernel $KERNEL"
+else
+    BOOT="-fda ${IMAGE:-bench.img}"
+fi
+
+timeout "$TIMEOUT" $QEMU $BOOT -display none -serial none \
+    -debugcon file:"$LOG" -device isa-debug-exit,iobase=0xf4,iosize=0x04 $QEMU_ARGS
+status=$?
+
+grep "^bench" "$LOG"
+
+if [ $status -eq 124 ]; then
+    echo "bench.img did not finish within ${TIMEOUT}s" >&2
+    exit 1
+fi
+
+if [ $status -ne 1 ]; then
+    echo "bench.img exited with status $(( status >> 1 ))" >&2
+    exit 1
+fi
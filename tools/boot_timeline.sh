@@ -0,0 +1,66 @@
+#!/bin/bash
+# Boot the image in QEMU several times and summarise the boot timeline the
+# kernel prints on debugcon (see boot_report in kernel.c).
+#
+#   RUNS=10 tools/boot_timeline.sh              # floppy boot of boot.img
+#   KERNEL=kernel.elf tools/boot_timeline.sh    # direct boot of kernel.elf
+
+RUNS=${RUNS:-5}
+QEMU=${QEMU:-qemu-system-i386}
+TIMEOUT=${TIMEOUT:-10}
+LOG=$(mktemp)
+OUT=$(mktemp)
+trap 'rm -f "$LOG" "$OUT"' EXIT
+
+if [ -n "$KERNEL" ]; then
+    BOOT="-kernel $KERNEL"
+else
+    BOOT="-fda ${IMAGE:-boot.img}"
+fi
+
+for run in $(seq 1 "$RUNS"); do
+    : > "$LOG"
+    $QEMU $BOOT -display none -debugcon file:"$LOG" $QEMU_ARGS &
+    pid=$!
+
+    waited=0
+    while ! grep -q "^boot total_us=" "$LOG"; do
+        sleep 0.1
+        waited=$((waited + 1))
+        if [ $waited -ge $((TIMEOUT * 10)) ]; then
+            echo "run $run: no boot report after ${TIMEOUT}s" >&2
+            break
+        fi
+    done
+
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    grep "^boot " "$LOG" >> "$OUT"
+done
+
+# Per phase: min / mean / max microseconds across runs
+awk '
+    {
+        for (i = 2; i <= NF; i++) {
+            split($i, kv, "=")
+            f[kv[1]] = kv[2]
+        }
+        if ("phase" in f) { name = f["phase"]; us = f["us"] }
+        else if ("total_us" in f) { name = "total"; us = f["total_us"] }
+        else { delete f; next }
+        delete f
+
+        if (!(name in n)) { order[++phases] = name; min[name] = us; max[name] = us }
+        n[name]++
+        sum[name] += us
+        if (us < min[name]) min[name] = us
+        if (us > max[name]) max[name] = us
+    }
+    END {
+        printf "%-14s %5s %10s %10s %10s\n", "phase", "runs", "min_us", "mean_us", "max_us"
+        for (i = 1; i <= phases; i++) {
+            p = order[i]
+            printf "%-14s %5d %10d %10d %10d\n", p, n[p], min[p], sum[p] / n[p], max[p]
+        }
+    }
+' "$OUT"